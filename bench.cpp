@@ -0,0 +1,380 @@
+// bench.cpp - calc_bench: reproducible throughput benchmarks over synthetic
+// corpora, reported as JSON for comparing releases.
+//
+//     calc_bench [--seed N] [--bytes N] [--reps N] [--only NAME[,NAME...]] [--dump NAME] [--out FILE]
+//
+// Each workload is a corpus of roughly --bytes of one-expression lines built
+// from a fixed seed with a self-contained generator, so the same seed gives
+// the same corpus on every platform and standard library. Per workload it
+// times three things over the whole corpus, keeping the median and best of
+// --reps runs:
+//   lex         Lexer::tokenize alone, also reported in GB/s
+//   parse       lex + compile each line (Parser::tryCompile)
+//   eval        run the programs compiled from the lines that compile
+//   end_to_end  Parser::tryParse on each line, as --batch does
+// "checksum" hashes every result's bits and error code, so a change in what
+// the corpus evaluates to shows up next to a change in how fast it does.
+#include "calc.hpp"
+#include "bench.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+using namespace std;
+using namespace calc;
+
+// ---- corpus generation ----
+// splitmix64: tiny, and unlike <random>'s distributions its output is the same
+// everywhere.
+class Rng {
+    uint64_t s;
+
+public:
+    explicit Rng(uint64_t seed) : s(seed) {}
+    uint64_t next() {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+    // uniform in [lo, hi]
+    int in(int lo, int hi) { return lo + static_cast<int>(next() % static_cast<uint64_t>(hi - lo + 1)); }
+    bool chance(int percent) { return in(1, 100) <= percent; }
+};
+
+static void number(Rng& r, string& s) {
+    s += to_string(r.in(1, 999));
+    if (r.chance(30)) { s += '.'; s += to_string(r.in(0, 99)); }
+}
+
+static void sciNumber(Rng& r, string& s) {
+    s += to_string(r.in(1, 9));
+    if (r.chance(70)) { s += '.'; s += to_string(r.in(0, 9999)); }
+    s += r.chance(50) ? 'e' : 'E';
+    int e = r.in(-30, 30);
+    if (e >= 0 && r.chance(30)) s += '+';
+    s += to_string(e);
+}
+
+// 100-300 terms of + (and some -)
+static string plusChain(Rng& r) {
+    string s;
+    int n = r.in(100, 300);
+    for (int i = 0; i < n; ++i) {
+        if (i) s += r.chance(85) ? '+' : '-';
+        number(r, s);
+    }
+    return s;
+}
+
+// one sum nested 50-500 parentheses deep
+static string deepParens(Rng& r) {
+    string s;
+    int d = r.in(50, 500);
+    s.append(static_cast<size_t>(d), '(');
+    number(r, s);
+    for (int i = 0; i < d; ++i) {
+        s += "+-*"[r.in(0, 2)];
+        number(r, s);
+        s += ')';
+    }
+    return s;
+}
+
+// right-associative towers 2-30 high of bases just above 1, so they stay finite
+static string powTower(Rng& r) {
+    string s;
+    int n = r.in(2, 30);
+    for (int i = 0; i < n; ++i) {
+        if (i) s += '^';
+        s += "1.0";
+        s += to_string(r.in(0, 9));
+        s += to_string(r.in(1, 9));
+    }
+    return s;
+}
+
+// products written by juxtaposition: 2(3+4)(5-1)(6)
+static string implicitMul(Rng& r) {
+    string s;
+    if (r.chance(50)) number(r, s);
+    int n = r.in(5, 20);
+    for (int i = 0; i < n; ++i) {
+        s += '(';
+        number(r, s);
+        if (r.chance(80)) {
+            s += "+-"[r.in(0, 1)];
+            number(r, s);
+        }
+        s += ')';
+    }
+    return s;
+}
+
+// 5-20 literals in scientific notation
+static string scientific(Rng& r) {
+    string s;
+    int n = r.in(5, 20);
+    for (int i = 0; i < n; ++i) {
+        if (i) s += "+-*/"[r.in(0, 3)];
+        sciNumber(r, s);
+    }
+    return s;
+}
+
+// A short valid expression, then one of the ways a line can go wrong in
+// about half of the lines.
+static string malformed(Rng& r) {
+    string s;
+    int n = r.in(3, 12);
+    for (int i = 0; i < n; ++i) {
+        if (i) s += "+-*/"[r.in(0, 3)];
+        if (r.chance(20)) {
+            s += '(';
+            number(r, s);
+            s += "+-"[r.in(0, 1)];
+            number(r, s);
+            s += ')';
+        } else {
+            number(r, s);
+        }
+    }
+    if (r.chance(50)) return s;
+    switch (r.in(0, 6)) {
+    case 0: return s + "+";                  // expected number
+    case 1: return "(" + s;                  // missing ')'
+    case 2: return s + " 2)";                // trailing input
+    case 3: return s + "/0";                 // division by zero
+    case 4: return s + "%0";                 // modulo by zero
+    case 5: return s + "*1e999";             // number out of range
+    default: return s + "+rate";             // unbound variable
+    }
+}
+
+// Machine-generated output: one line of up to 1 MB, a sum of products of
+// long literals and generated names, indented and padded with runs of blanks.
+static string generated(Rng& r) {
+    string s;
+    size_t target = static_cast<size_t>(r.in(256, 1024)) << 10;
+    while (s.size() < target) {
+        if (!s.empty()) s += r.chance(80) ? " +" : " -";
+        s.append(static_cast<size_t>(r.in(1, 24)), r.chance(70) ? ' ' : '\t');
+        s += to_string(r.next() % 1000000000000ull);
+        s += '.';
+        s += to_string(r.next() % 100000000ull);
+        s += " * ";
+        if (r.chance(50)) {
+            s += "coefficient_" + to_string(r.in(0, 63));
+        } else {
+            s += "(  ";
+            sciNumber(r, s);
+            s += "   )";
+        }
+    }
+    return s;
+}
+
+struct Workload {
+    const char* name;
+    string (*line)(Rng&);
+};
+
+static const Workload kWorkloads[] = {
+    {"plus_chain", plusChain},   {"deep_parens", deepParens}, {"pow_tower", powTower},
+    {"implicit_mul", implicitMul}, {"scientific", scientific}, {"malformed", malformed},
+    {"mixed", nullptr}, // a line from each of the workloads above in turn
+    {"generated", generated},
+};
+
+static constexpr size_t kWorkloadCount = sizeof(kWorkloads) / sizeof(kWorkloads[0]);
+static constexpr size_t kMixed = 6; // draws from the workloads before it
+
+// Each workload draws from its own stream, so --only does not shift the others.
+static vector<string> corpus(size_t which, uint64_t seed, size_t bytes) {
+    const Workload& w = kWorkloads[which];
+    Rng r(seed * 0x100000001B3ull + which);
+    vector<string> lines;
+    size_t total = 0;
+    while (total < bytes) {
+        lines.push_back(w.line ? w.line(r) : kWorkloads[lines.size() % kMixed].line(r));
+        total += lines.back().size() + 1;
+    }
+    return lines;
+}
+
+// ---- measurement ----
+struct Timing {
+    double median = 0, best = 0; // seconds per pass over the corpus
+};
+
+template <class F>
+static Timing measure(int reps, F&& pass) {
+    vector<double> t;
+    for (int i = 0; i < reps; ++i) {
+        auto t0 = chrono::steady_clock::now();
+        pass();
+        t.push_back(chrono::duration<double>(chrono::steady_clock::now() - t0).count());
+    }
+    sort(t.begin(), t.end());
+    return Timing{t[t.size() / 2], t[0]};
+}
+
+struct Checksum {
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a over each result
+    void add(const EvalResult& r) {
+        uint64_t bits;
+        memcpy(&bits, &r.value, sizeof(bits));
+        if (!r.ok()) bits = static_cast<uint64_t>(r.error);
+        for (int i = 0; i < 8; ++i) h = (h ^ ((bits >> (8 * i)) & 0xff)) * 0x100000001b3ull;
+    }
+};
+
+static void jsonTiming(string& out, const char* key, const Timing& t, size_t lines, size_t bytes, bool gb = false) {
+    char buf[320];
+    int n = snprintf(buf, sizeof(buf),
+                     "\"%s\": {\"ns_per_line\": %.2f, \"best_ns_per_line\": %.2f, \"lines_per_s\": %.0f, \"mb_per_s\": %.2f",
+                     key, t.median * 1e9 / lines, t.best * 1e9 / lines, lines / t.median, bytes / t.median / 1e6);
+    if (gb) snprintf(buf + n, sizeof(buf) - n, ", \"gb_per_s\": %.3f, \"best_gb_per_s\": %.3f", bytes / t.median / 1e9,
+                     bytes / t.best / 1e9);
+    out += buf;
+    out += '}';
+}
+
+static string runWorkload(size_t which, uint64_t seed, size_t targetBytes, int reps) {
+    const Workload& w = kWorkloads[which];
+    vector<string> lines = corpus(which, seed, targetBytes);
+    size_t bytes = 0;
+    for (const string& s : lines) bytes += s.size() + 1;
+
+    Parser p("");
+    vector<Program> programs;
+    size_t compileErrors = 0, evalErrors = 0, compiledBytes = 0;
+    Checksum sum;
+    for (const string& s : lines) {
+        p.reset(s);
+        EvalResult r = p.tryCompile();
+        if (!r.ok()) { ++compileErrors; sum.add(r); continue; }
+        programs.push_back(p.program());
+        compiledBytes += s.size() + 1;
+        r = programs.back().tryRun();
+        evalErrors += !r.ok();
+        sum.add(r);
+    }
+
+    vector<Token> toks;
+    Timing lex = measure(reps, [&] {
+        for (const string& s : lines) {
+            Lexer::tokenize(s, toks);
+            doNotOptimize(toks.size());
+        }
+    });
+    Timing parse = measure(reps, [&] {
+        for (const string& s : lines) {
+            p.reset(s);
+            doNotOptimize(p.tryCompile().ok());
+        }
+    });
+    Timing eval = measure(reps, [&] {
+        for (const Program& prog : programs) doNotOptimize(prog.tryRun().value);
+    });
+    Timing e2e = measure(reps, [&] {
+        for (const string& s : lines) {
+            p.reset(s);
+            doNotOptimize(p.tryParse().value);
+        }
+    });
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+             "    {\"name\": \"%s\", \"lines\": %zu, \"bytes\": %zu, \"compile_errors\": %zu, \"eval_errors\": %zu, "
+             "\"checksum\": \"%016llx\",\n      ",
+             w.name, lines.size(), bytes, compileErrors, evalErrors, static_cast<unsigned long long>(sum.h));
+    string out = buf;
+    jsonTiming(out, "lex", lex, lines.size(), bytes, true);
+    out += ",\n      ";
+    jsonTiming(out, "parse", parse, lines.size(), bytes);
+    out += ",\n      ";
+    jsonTiming(out, "eval", eval, max<size_t>(programs.size(), 1), compiledBytes);
+    out += ",\n      ";
+    jsonTiming(out, "end_to_end", e2e, lines.size(), bytes);
+    out += "}";
+    return out;
+}
+
+static bool selected(const string& only, const char* name) {
+    if (only.empty()) return true;
+    size_t start = 0;
+    while (start <= only.size()) {
+        size_t end = only.find(',', start);
+        if (end == string::npos) end = only.size();
+        if (only.compare(start, end - start, name) == 0) return true;
+        start = end + 1;
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    uint64_t seed = 1;
+    size_t bytes = 4 << 20;
+    int reps = 5;
+    string only;
+    const char* dump = nullptr;
+    const char* outPath = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--seed" && i + 1 < argc) seed = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--bytes" && i + 1 < argc) bytes = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--reps" && i + 1 < argc) reps = max(1, atoi(argv[++i]));
+        else if (arg == "--only" && i + 1 < argc) only = argv[++i];
+        else if (arg == "--dump" && i + 1 < argc) dump = argv[++i];
+        else if (arg == "--out" && i + 1 < argc) outPath = argv[++i];
+        else {
+            fprintf(stderr,
+                    "Usage: %s [--seed N] [--bytes N] [--reps N] [--only NAME[,NAME...]] [--dump NAME] [--out FILE]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    // --dump NAME: write the corpus itself, e.g. to feed calc --batch
+    if (dump) {
+        for (size_t i = 0; i < kWorkloadCount; ++i) {
+            if (strcmp(kWorkloads[i].name, dump) != 0) continue;
+            for (const string& s : corpus(i, seed, bytes)) printf("%s\n", s.c_str());
+            return 0;
+        }
+        fprintf(stderr, "Unknown workload: %s\n", dump);
+        return 2;
+    }
+
+    string json = "{\n  \"schema\": 1,\n  \"seed\": " + to_string(seed) + ",\n  \"target_bytes\": " +
+                  to_string(bytes) + ",\n  \"reps\": " + to_string(reps) + ",\n  \"batch_isa\": \"" +
+                  batchKernels().isa + "\",\n  \"lex_isa\": \"" + lexKernels().isa + "\",\n  \"compiler\": \"" +
+#if defined(__clang__)
+                  "clang " __clang_version__
+#elif defined(__GNUC__)
+                  "gcc " __VERSION__
+#else
+                  "unknown"
+#endif
+                  + "\",\n  \"workloads\": [\n";
+    bool first = true;
+    for (size_t i = 0; i < kWorkloadCount; ++i) {
+        if (!selected(only, kWorkloads[i].name)) continue;
+        if (!first) json += ",\n";
+        first = false;
+        json += runWorkload(i, seed, bytes, reps);
+        fprintf(stderr, "%s done\n", kWorkloads[i].name);
+    }
+    json += "\n  ]\n}\n";
+
+    FILE* out = outPath ? fopen(outPath, "w") : stdout;
+    if (!out) { perror(outPath); return 1; }
+    fputs(json.c_str(), out);
+    if (out != stdout) fclose(out);
+    return 0;
+}
@@ -0,0 +1,15 @@
+// bench.hpp - what calc --bench and calc_bench share for timing loops.
+#ifndef CALC_BENCH_HPP
+#define CALC_BENCH_HPP
+
+// Makes v count as used, so the compiler has to compute it. The empty asm
+// statement takes v as an input and clobbers memory, which also makes it a
+// full compiler barrier: work on memory is not hoisted out of the timed loop
+// or merged across iterations, and loop state the compiler kept in memory is
+// reloaded after each call. It emits no instruction itself.
+template <class T>
+inline void doNotOptimize(const T& v) {
+    asm volatile("" : : "r,m"(v) : "memory");
+}
+
+#endif // CALC_BENCH_HPP
@@ -0,0 +1,125 @@
+/* calc.h - C interface to the expression engine.
+ *
+ * Stable across releases: handles are opaque and new entry points are only
+ * ever added. calc_result is returned by value and calc_limits is allocated by
+ * the caller, so both layouts are frozen: new information comes through new
+ * functions, and a change to either struct bumps CALC_ABI_VERSION like any
+ * other incompatible change. No C++ exception crosses this boundary.
+ * Everything is in-process; a calc_parser is reused across inputs and stops
+ * allocating once it has seen its largest one.
+ *
+ *     calc_parser* p = calc_parser_new();
+ *     calc_result r = calc_eval(p, "3.5(2)+1e-3", 11);
+ *     if (r.error != CALC_OK) { char msg[128]; calc_error_message(&r, msg, sizeof msg); }
+ *     calc_parser_free(p);
+ *
+ * A calc_parser or calc_program may be used from one thread at a time;
+ * distinct handles are independent. calc_program_run is const and may be
+ * called concurrently on the same program.
+ */
+#ifndef CALC_H
+#define CALC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#if defined(CALC_BUILDING_SHARED)
+#define CALC_API __declspec(dllexport)
+#elif defined(CALC_USING_SHARED)
+#define CALC_API __declspec(dllimport)
+#else
+#define CALC_API
+#endif
+#else
+#define CALC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CALC_ABI_VERSION 1
+
+/* calc_result.error; values match calc::ErrorCode */
+enum {
+    CALC_OK = 0,
+    CALC_EXPECTED_NUMBER = 1,
+    CALC_NUMBER_OUT_OF_RANGE = 2,
+    CALC_MISSING_PAREN = 3,
+    CALC_TRAILING_INPUT = 4,
+    CALC_DIVISION_BY_ZERO = 5,
+    CALC_MODULO_BY_ZERO = 6,
+    CALC_UNBOUND_VARIABLE = 7,
+    CALC_CYCLIC_DEFINITION = 8,
+    CALC_BAD_ASSIGNMENT = 9,
+    CALC_INPUT_TOO_LONG = 10,
+    CALC_TOO_MANY_TOKENS = 11,
+    CALC_NESTING_TOO_DEEP = 12,
+    CALC_TOO_MANY_STEPS = 13,
+    CALC_OUT_OF_MEMORY = 100,
+};
+
+typedef struct calc_result {
+    double value;
+    int32_t error;      /* CALC_OK or one of the codes above */
+    size_t pos;         /* byte offset into the source, where it applies */
+    const char* detail; /* e.g. the unbound variable's name; not NUL-terminated, */
+    size_t detail_len;  /* valid until the parser or program is reused or freed */
+} calc_result;
+
+/* Per-expression budgets (0 = unlimited); going over one fails with the
+ * matching CALC_INPUT_TOO_LONG .. CALC_TOO_MANY_STEPS as soon as it happens. */
+typedef struct calc_limits {
+    size_t input_bytes; /* source length */
+    size_t tokens;      /* tokens, not counting the end of input */
+    size_t depth;       /* parser nesting: parentheses, signs, '^' towers */
+    size_t steps;       /* compiled instructions; a run executes each once */
+} calc_limits;
+
+typedef struct calc_parser calc_parser;
+typedef struct calc_program calc_program;
+
+CALC_API uint32_t calc_abi_version(void);
+
+CALC_API calc_parser* calc_parser_new(void); /* NULL on allocation failure */
+CALC_API void calc_parser_free(calc_parser* p);
+
+/* Applies to every following calc_eval/calc_compile on p; NULL removes them. */
+CALC_API void calc_parser_set_limits(calc_parser* p, const calc_limits* limits);
+
+/* Parse and evaluate src[0..len) in one step. */
+CALC_API calc_result calc_eval(calc_parser* p, const char* src, size_t len);
+
+/* Compile src[0..len) into a program that can be run many times. Returns NULL
+ * and fills *status (if non-null) on a syntax error. */
+CALC_API calc_program* calc_compile(calc_parser* p, const char* src, size_t len, calc_result* status);
+CALC_API void calc_program_free(calc_program* prog);
+
+/* Number of instructions, for diagnostics; calc_compile does not optimize. */
+CALC_API size_t calc_program_size(const calc_program* prog);
+
+/* Variables in slot order (order of first appearance); names are NUL-terminated
+ * and live as long as the program. */
+CALC_API size_t calc_program_variable_count(const calc_program* prog);
+CALC_API const char* calc_program_variable_name(const calc_program* prog, size_t slot);
+
+/* vars[i] is the value of variable i; may be NULL if there are none. */
+CALC_API calc_result calc_program_run(const calc_program* prog, const double* vars);
+
+/* columns[i] holds variable i for each of rows rows; out receives one result
+ * per row. Rows run 512 at a time, one instruction over the whole chunk, so a
+ * failure is the first instruction (in program order) that divides or takes a
+ * modulo by zero in any row of the first failing chunk; the result carries no
+ * row index, and out is then only partly written. */
+CALC_API calc_result calc_program_run_batch(const calc_program* prog, const double* const* columns, size_t rows,
+                                            double* out);
+
+/* Message for r, always NUL-terminated; returns its length like snprintf. */
+CALC_API int calc_error_message(const calc_result* r, char* buf, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CALC_H */
@@ -0,0 +1,2784 @@
+// calc.hpp - the expression engine: lexer, parser, compiled programs and
+// their evaluators. Link against libcalc (see CMakeLists.txt); calc.h is the
+// C interface to the same engine.
+#ifndef CALC_HPP
+#define CALC_HPP
+
+#include "calc.h"
+
+#include <string>
+#include <string_view>
+#include <charconv>
+#include <cctype>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <exception>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <type_traits>
+#include <condition_variable>
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define CALC_HAS_COROUTINES 1
+#endif
+#endif
+#ifndef CALC_HAS_COROUTINES
+#define CALC_HAS_COROUTINES 0
+#endif
+
+namespace calc {
+
+// ---- batch kernels ----
+// Column kernels used by Program::runBatch(). Each one applies a single operator
+// across a chunk of rows; the variant is picked once at runtime from the CPU.
+// Every operator is one IEEE op per element, exactly like the scalar path, so
+// results are bit-identical, short of which NaN comes out when two meet. pow
+// has no exact vector form and stays per-lane; a constant x^0.5 can use the
+// sqrt kernel instead (Program::optimize).
+struct BatchKernels {
+    const char* isa;
+    void (*add)(double* a, const double* b, size_t n);
+    void (*sub)(double* a, const double* b, size_t n);
+    void (*mul)(double* a, const double* b, size_t n);
+    bool (*div)(double* a, const double* b, size_t n); // returns true if any b[i] == 0
+    void (*sqrt)(double* a, size_t n);                  // a[i] = powHalf(a[i])
+};
+
+// pow(x, 0.5) through sqrt: pow gives +0 for -0 and +inf for -inf where sqrt
+// gives -0 and NaN.
+inline double powHalf(double x) { return x == -INFINITY ? INFINITY : std::sqrt(x) + 0.0; }
+
+CALC_API const BatchKernels& batchKernels(); // picked once from the running CPU
+
+// ---- errors ----
+// Compile and run failures are reported as a code plus a source position. The
+// text is only formatted when someone asks for it, so the non-throwing entry
+// points (tryCompile/tryParse/tryRun) never allocate or unwind on bad input.
+enum class ErrorCode : uint8_t {
+    None,
+    ExpectedNumber,
+    NumberOutOfRange,
+    MissingParen,
+    TrailingInput,
+    DivisionByZero,
+    ModuloByZero,
+    UnboundVariable,
+    CyclicDefinition, // Session: a formula that would depend on itself
+    BadAssignment,    // Session: a line that is not "name = formula"
+    InputTooLong,     // over Limits::inputBytes
+    TooManyTokens,    // over Limits::tokens
+    NestingTooDeep,   // over Limits::depth
+    TooManySteps,     // over Limits::steps
+};
+constexpr size_t kErrorCodes = static_cast<size_t>(ErrorCode::TooManySteps) + 1;
+
+struct EvalResult {
+    double value = 0;
+    int64_t exact = 0;     // tryRunExact: the exact value when integral is set
+    bool integral = false; // tryRunExact: the result stayed an exact int64
+    ErrorCode error = ErrorCode::None;
+    size_t pos = 0;     // byte offset into the source, where it applies
+    std::string_view detail; // e.g. the unbound variable's name (points into the Program)
+
+    bool ok() const { return error == ErrorCode::None; }
+
+    // Writes the human-readable message into buf (always NUL-terminated) and
+    // returns its length, like snprintf.
+    int format(char* buf, size_t n) const {
+        switch (error) {
+        case ErrorCode::None:             return snprintf(buf, n, "OK");
+        case ErrorCode::ExpectedNumber:   return snprintf(buf, n, "Expected number at pos %zu", pos);
+        case ErrorCode::NumberOutOfRange: return snprintf(buf, n, "Number out of range at pos %zu", pos);
+        case ErrorCode::MissingParen:     return snprintf(buf, n, "Missing ')'");
+        case ErrorCode::TrailingInput:    return snprintf(buf, n, "Unexpected trailing input at pos %zu", pos);
+        case ErrorCode::DivisionByZero:   return snprintf(buf, n, "Division by zero");
+        case ErrorCode::ModuloByZero:     return snprintf(buf, n, "Modulo by zero");
+        case ErrorCode::UnboundVariable:
+            return snprintf(buf, n, "Unbound variable '%.*s'", static_cast<int>(detail.size()), detail.data());
+        case ErrorCode::CyclicDefinition:
+            return snprintf(buf, n, "Cyclic definition of '%.*s'", static_cast<int>(detail.size()), detail.data());
+        case ErrorCode::BadAssignment:    return snprintf(buf, n, "Expected 'name = formula' at pos %zu", pos);
+        case ErrorCode::InputTooLong:     return snprintf(buf, n, "Input too long at pos %zu", pos);
+        case ErrorCode::TooManyTokens:    return snprintf(buf, n, "Too many tokens at pos %zu", pos);
+        case ErrorCode::NestingTooDeep:   return snprintf(buf, n, "Nesting too deep at pos %zu", pos);
+        case ErrorCode::TooManySteps:     return snprintf(buf, n, "Too many evaluation steps at pos %zu", pos);
+        }
+        return snprintf(buf, n, "Unknown error");
+    }
+    std::string message() const {
+        char buf[128];
+        int len = format(buf, sizeof(buf));
+        return std::string(buf, static_cast<size_t>(std::min<int>(len, sizeof(buf) - 1)));
+    }
+};
+
+// Thrown by the throwing wrappers (compile/parse/run/runBatch).
+class CalcError : public std::exception {
+    ErrorCode err;
+    size_t where;
+    char msg[96];
+
+public:
+    explicit CalcError(const EvalResult& r) : err(r.error), where(r.pos) { r.format(msg, sizeof(msg)); }
+    ErrorCode code() const { return err; }
+    size_t pos() const { return where; }
+    const char* what() const noexcept override { return msg; }
+};
+
+inline EvalResult failure(ErrorCode code, size_t pos, std::string_view detail = {}) {
+    EvalResult r;
+    r.error = code;
+    r.pos = pos;
+    r.detail = detail;
+    return r;
+}
+
+// ---- compiled program ----
+// A flat postfix (stack machine) encoding of one expression. Compiling once and
+// calling run() many times skips all of the scanning and string handling.
+// Variables are resolved to slot indices at compile time, so running a program
+// only reads a flat array of doubles.
+//
+// Square, Cube, PowInt and Sqrt are '^' with a constant exponent: x^2, x^3,
+// x^n for a small integer n (exponentiation by squaring) and x^0.5.
+enum class Op : uint8_t { Const, Load, Neg, Add, Sub, Mul, Div, Mod, Pow, Square, Cube, PowInt, Sqrt };
+
+inline bool isUnary(Op op) { return op == Op::Neg || op >= Op::Square; }
+
+struct Instr {
+    Op op;
+    double value = 0;  // Op::Const; the exponent for Op::PowInt
+    uint32_t slot = 0; // Op::Load; for Op::Const, 1 + index into Program::bigInts if the
+                       // literal is an integer too large for value to hold exactly
+    uint32_t pos = 0;  // source offset of the operator, for Div/Mod errors
+};
+
+// x % y as the grammar defines it: both sides truncated to integers first.
+// The caller has already rejected y == 0 (see modByZero).
+constexpr double modValues(double x, double y) {
+    constexpr double range = 9223372036854775808.0; // 2^63
+    auto inRange = [](double v) { return v > -range && v < range; };
+    if (inRange(x) && inRange(y)) {
+        long long a = static_cast<long long>(x);
+        long long b = static_cast<long long>(y);
+        return static_cast<double>(b == -1 ? 0 : a % b); // LLONG_MIN % -1 traps
+    }
+    // Past int64 every finite double is an integer already. Reduce |x| by
+    // |y| * 2^k, largest k first: each subtraction is exact, as in fmod.
+    if (x != x || y != y || x - x != 0) return std::numeric_limits<double>::quiet_NaN();
+    if (inRange(x)) return static_cast<double>(static_cast<long long>(x)); // |x| < |y|
+    double ay = inRange(y) ? static_cast<double>(static_cast<long long>(y)) : y;
+    if (ay < 0) ay = -ay;
+    if (ay - ay != 0) return x; // y is inf
+    double r = x < 0 ? -x : x, t = ay;
+    while (t <= r / 2) t *= 2;
+    for (; t >= ay; t /= 2)
+        if (r >= t) r -= t;
+    return (x < 0 ? -r : r) + 0.0; // never -0, like the int path
+}
+// y truncates to 0. Out-of-range and NaN divisors do not, as with cvttsd2si.
+constexpr bool modByZero(double y) { return y > -1 && y < 1; }
+
+// x^e by squaring. The batch version below multiplies in the same order, so
+// the two agree bit for bit.
+inline double powInt(double x, int e) {
+    double acc = 1, b = x;
+    for (unsigned u = e < 0 ? 0u - unsigned(e) : unsigned(e); u; ) {
+        if (u & 1) acc *= b;
+        u >>= 1;
+        if (u) b *= b;
+    }
+    return e < 0 ? 1 / acc : acc;
+}
+
+// Integer x^e; false on overflow.
+inline bool powExact(int64_t base, uint64_t e, int64_t* out) {
+    int64_t acc = 1;
+    for (; e; e >>= 1) {
+        if ((e & 1) && __builtin_mul_overflow(acc, base, &acc)) return false;
+        if (e > 1 && __builtin_mul_overflow(base, base, &base)) return false;
+    }
+    *out = acc;
+    return true;
+}
+
+// Result of a unary op on x; param is Instr::value (the PowInt exponent).
+inline double unaryValue(Op op, double param, double x) {
+    switch (op) {
+    case Op::Neg:    return -x;
+    case Op::Square: return x * x;
+    case Op::Cube:   return x * (x * x);
+    case Op::PowInt: return powInt(x, static_cast<int>(param));
+    case Op::Sqrt:   return powHalf(x);
+    default:         return x;
+    }
+}
+
+// Column form of unaryValue(), in place on a[0..n); tmp is n doubles of scratch.
+inline void unaryBatch(const BatchKernels& k, Op op, double param, double* a, double* tmp, size_t n) {
+    switch (op) {
+    case Op::Neg:    for (size_t i = 0; i < n; ++i) a[i] = -a[i]; break;
+    case Op::Square: k.mul(a, a, n); break;
+    case Op::Cube:   memcpy(tmp, a, n * sizeof(double)); k.mul(a, a, n); k.mul(a, tmp, n); break;
+    case Op::PowInt: {
+        int e = static_cast<int>(param);
+        memcpy(tmp, a, n * sizeof(double));
+        std::fill(a, a + n, 1.0);
+        for (unsigned u = e < 0 ? 0u - unsigned(e) : unsigned(e); u; ) {
+            if (u & 1) k.mul(a, tmp, n);
+            u >>= 1;
+            if (u) k.mul(tmp, tmp, n);
+        }
+        if (e < 0) for (size_t i = 0; i < n; ++i) a[i] = 1 / a[i];
+        break;
+    }
+    case Op::Sqrt:   k.sqrt(a, n); break;
+    default: break;
+    }
+}
+
+// The unary op that replaces "^ e" for a constant exponent, or Op::Pow. x*x
+// is the correctly rounded square, which is what pow returns for e == 2. The
+// rest can differ from pow in the last bit (sqrt is correctly rounded where
+// pow is not always; the multiply chains round once per step), so they are
+// only used when strict is false.
+inline Op powByConstant(double e, bool strict) {
+    if (e == 2) return Op::Square;
+    if (strict) return Op::Pow;
+    if (e == 0.5) return Op::Sqrt;
+    if (e == 3) return Op::Cube;
+    if (e == std::floor(e) && std::fabs(e) <= 64) return Op::PowInt;
+    return Op::Pow;
+}
+
+struct OptimizeReport {
+    size_t before = 0; // instructions before optimize()
+    size_t after = 0;
+};
+
+// A non-owning view of compiled code, which is all the evaluators need.
+// Program hands one out over its own vectors, ProgramImage over a mapped file.
+class ProgramRef {
+    const Instr* code = nullptr;
+    size_t codeSize = 0;
+    const int64_t* bigInts = nullptr; // see Instr::slot
+    size_t maxDepth = 0;
+    size_t nameCount = 0;
+    std::string_view firstName; // reported when run without variables
+
+    EvalResult unbound() const { return failure(ErrorCode::UnboundVariable, 0, firstName); }
+
+    struct Instrs {
+        const Instr *b, *e;
+        const Instr* begin() const { return b; }
+        const Instr* end() const { return e; }
+    };
+    Instrs instrs() const { return {code, code + codeSize}; }
+
+public:
+    ProgramRef() = default;
+    ProgramRef(const Instr* code, size_t codeSize, const int64_t* bigInts, size_t maxDepth, size_t nameCount,
+               std::string_view firstName)
+        : code(code), codeSize(codeSize), bigInts(bigInts), maxDepth(maxDepth), nameCount(nameCount),
+          firstName(firstName) {}
+
+    size_t size() const { return codeSize; }
+    size_t variableCount() const { return nameCount; }
+
+    // vars[i] is the value of variable slot i; may be null if there are none.
+    double run(const double* vars = nullptr) const {
+        EvalResult r = tryRun(vars);
+        if (!r.ok()) throw CalcError(r);
+        return r.value;
+    }
+
+    // Integer-exact evaluation. Values stay int64 while they are integral and
+    // every step is checked with __builtin_*_overflow; a value becomes double
+    // only on overflow or a non-integral result (e.g. 7/2, 2^-1, a fractional
+    // variable). % on two ints is exact at any magnitude, unlike run(), which
+    // truncates through double. A double result that is a whole number up to
+    // 2^53 (and not -0) is integral again, whichever operator produced it. The
+    // result reports integral/exact when the final value is.
+    EvalResult tryRunExact(const double* vars = nullptr) const {
+        if (!vars && nameCount) return unbound();
+        struct Num {
+            bool isInt;
+            int64_t i;
+            double d;
+            double asDouble() const { return isInt ? static_cast<double>(i) : d; }
+        };
+        auto fromDouble = [](double v) {
+            constexpr double limit = 9007199254740992.0; // 2^53: every integer below is exact
+            if (v == std::floor(v) && std::fabs(v) <= limit && !(v == 0 && std::signbit(v)))
+                return Num{true, static_cast<int64_t>(v), v};
+            return Num{false, 0, v};
+        };
+        auto fromInt = [](int64_t v) { return Num{true, v, 0}; };
+        auto real = [](double v) { return Num{false, 0, v}; };
+        Num small[64];
+        std::vector<Num> big;
+        Num* st = small;
+        if (maxDepth > 64) { big.resize(maxDepth); st = big.data(); }
+        size_t sp = 0;
+        for (const Instr& in : instrs()) {
+            if (in.op == Op::Const) {
+                st[sp++] = in.slot ? fromInt(bigInts[in.slot - 1]) : fromDouble(in.value);
+                continue;
+            }
+            if (in.op == Op::Load) { st[sp++] = fromDouble(vars[in.slot]); continue; }
+            if (in.op == Op::Neg) {
+                Num& x = st[sp - 1];
+                if (x.isInt && x.i != 0 && x.i != INT64_MIN) x.i = -x.i;
+                else x = real(-x.asDouble()); // -0 is a double, as in tryRun()
+                continue;
+            }
+            if (isUnary(in.op)) {
+                Num& x = st[sp - 1];
+                int64_t e = in.op == Op::Square ? 2 : in.op == Op::Cube ? 3 :
+                            in.op == Op::PowInt ? static_cast<int64_t>(in.value) : -1;
+                int64_t out;
+                if (x.isInt && e >= 0 && powExact(x.i, static_cast<uint64_t>(e), &out)) x = fromInt(out);
+                else x = fromDouble(unaryValue(in.op, in.value, x.asDouble()));
+                continue;
+            }
+            --sp;
+            Num a = st[sp - 1], b = st[sp];
+            Num& r = st[sp - 1];
+            // Ints stay exact while the operation does; otherwise the double
+            // result is taken by value, like a literal (see fromDouble). A zero
+            // product or quotient goes through double too, for its sign.
+            int64_t out;
+            bool both = a.isInt && b.isInt;
+            switch (in.op) {
+            case Op::Add:
+                r = (both && !__builtin_add_overflow(a.i, b.i, &out)) ? fromInt(out) : fromDouble(a.asDouble() + b.asDouble());
+                break;
+            case Op::Sub:
+                r = (both && !__builtin_sub_overflow(a.i, b.i, &out)) ? fromInt(out) : fromDouble(a.asDouble() - b.asDouble());
+                break;
+            case Op::Mul:
+                r = (both && !__builtin_mul_overflow(a.i, b.i, &out) && out) ? fromInt(out) : fromDouble(a.asDouble() * b.asDouble());
+                break;
+            case Op::Div:
+                if (b.asDouble() == 0) return failure(ErrorCode::DivisionByZero, in.pos);
+                if (both && a.i && !(a.i == INT64_MIN && b.i == -1) && a.i % b.i == 0) r = fromInt(a.i / b.i);
+                else r = fromDouble(a.asDouble() / b.asDouble());
+                break;
+            case Op::Mod:
+                if (both) {
+                    if (b.i == 0) return failure(ErrorCode::ModuloByZero, in.pos);
+                    r = fromInt(b.i == -1 ? 0 : a.i % b.i);
+                } else {
+                    if (modByZero(b.asDouble())) return failure(ErrorCode::ModuloByZero, in.pos);
+                    r = fromDouble(modValues(a.asDouble(), b.asDouble()));
+                }
+                break;
+            case Op::Pow:
+                if (both && b.i >= 0 && powExact(a.i, static_cast<uint64_t>(b.i), &out)) r = fromInt(out);
+                else r = fromDouble(std::pow(a.asDouble(), b.asDouble()));
+                break;
+            default: break;
+            }
+        }
+        EvalResult res;
+        if (sp) {
+            res.value = st[sp - 1].asDouble();
+            res.integral = st[sp - 1].isInt;
+            res.exact = st[sp - 1].i;
+        }
+        return res;
+    }
+
+    EvalResult tryRun(const double* vars = nullptr) const {
+        if (!vars && nameCount) return unbound();
+        // Most expressions fit in a small fixed stack; deep '^' towers spill to the heap.
+        double small[64];
+        std::vector<double> big;
+        double* st = small;
+        if (maxDepth > 64) { big.resize(maxDepth); st = big.data(); }
+        size_t sp = 0;
+        for (const Instr& in : instrs()) {
+            switch (in.op) {
+            case Op::Const: st[sp++] = in.value; break;
+            case Op::Load:  st[sp++] = vars[in.slot]; break;
+            case Op::Neg:   st[sp - 1] = -st[sp - 1]; break;
+            case Op::Add:   --sp; st[sp - 1] += st[sp]; break;
+            case Op::Sub:   --sp; st[sp - 1] -= st[sp]; break;
+            case Op::Mul:   --sp; st[sp - 1] *= st[sp]; break;
+            case Op::Div:
+                --sp;
+                if (st[sp] == 0) return failure(ErrorCode::DivisionByZero, in.pos);
+                st[sp - 1] /= st[sp];
+                break;
+            case Op::Mod:
+                --sp;
+                if (modByZero(st[sp])) return failure(ErrorCode::ModuloByZero, in.pos);
+                st[sp - 1] = modValues(st[sp - 1], st[sp]);
+                break;
+            case Op::Pow:   --sp; st[sp - 1] = std::pow(st[sp - 1], st[sp]); break;
+            case Op::Square: st[sp - 1] *= st[sp - 1]; break;
+            case Op::Cube:  st[sp - 1] *= st[sp - 1] * st[sp - 1]; break;
+            case Op::PowInt: st[sp - 1] = powInt(st[sp - 1], static_cast<int>(in.value)); break;
+            case Op::Sqrt:  st[sp - 1] = powHalf(st[sp - 1]); break;
+            }
+        }
+        EvalResult r;
+        r.value = sp ? st[sp - 1] : 0;
+        return r;
+    }
+
+    // Evaluate over `rows` bindings at once: columns[i] holds the values of
+    // variable slot i and out receives one result per row. The program is run one
+    // operator at a time over chunks of rows using the batch kernels; fails if
+    // any row divides or takes a modulo by zero.
+    void runBatch(const double* const* columns, size_t rows, double* out) const {
+        EvalResult r = tryRunBatch(columns, rows, out);
+        if (!r.ok()) throw CalcError(r);
+    }
+
+    EvalResult tryRunBatch(const double* const* columns, size_t rows, double* out) const {
+        if (!columns && nameCount) return unbound();
+        const BatchKernels& k = batchKernels();
+        constexpr size_t chunk = 512;
+        std::vector<double> stack(std::max<size_t>(maxDepth, 1) * chunk), tmp(chunk);
+        for (size_t base = 0; base < rows; base += chunk) {
+            size_t n = std::min(chunk, rows - base);
+            size_t sp = 0;
+            auto col = [&](size_t i) { return stack.data() + i * chunk; };
+            for (const Instr& in : instrs()) {
+                switch (in.op) {
+                case Op::Const: std::fill(col(sp), col(sp) + n, in.value); ++sp; break;
+                case Op::Load:  memcpy(col(sp), columns[in.slot] + base, n * sizeof(double)); ++sp; break;
+                case Op::Neg: case Op::Square: case Op::Cube: case Op::PowInt: case Op::Sqrt:
+                    unaryBatch(k, in.op, in.value, col(sp - 1), tmp.data(), n);
+                    break;
+                case Op::Add:   --sp; k.add(col(sp - 1), col(sp), n); break;
+                case Op::Sub:   --sp; k.sub(col(sp - 1), col(sp), n); break;
+                case Op::Mul:   --sp; k.mul(col(sp - 1), col(sp), n); break;
+                case Op::Div:
+                    --sp;
+                    if (k.div(col(sp - 1), col(sp), n)) return failure(ErrorCode::DivisionByZero, in.pos);
+                    break;
+                case Op::Mod: {
+                    --sp;
+                    double* a = col(sp - 1);
+                    const double* b = col(sp);
+                    for (size_t i = 0; i < n; ++i) {
+                        if (modByZero(b[i])) return failure(ErrorCode::ModuloByZero, in.pos);
+                        a[i] = modValues(a[i], b[i]);
+                    }
+                    break;
+                }
+                case Op::Pow: {
+                    --sp;
+                    double* a = col(sp - 1);
+                    const double* b = col(sp);
+                    for (size_t i = 0; i < n; ++i) a[i] = std::pow(a[i], b[i]);
+                    break;
+                }
+                }
+            }
+            if (sp) memcpy(out + base, col(sp - 1), n * sizeof(double));
+        }
+        return EvalResult{};
+    }
+
+    // ---- derivatives ----
+    // Value and gradient in one forward and one reverse sweep over the code:
+    // grad[i] receives d(result)/d(variable i). The value is computed exactly
+    // as tryRun() computes it. Derivative rules are the usual ones; % truncates
+    // both sides to integers, so it is flat (derivative 0) wherever it is
+    // defined, and d(a^b)/db is taken as 0 where a^b is 0. Both modes use one
+    // rule (see chain): a term is 0 when its partial or the derivative it
+    // carries is 0, even where the other factor is inf or NaN, so
+    // tryDerivative() along a unit vector matches the same entry of grad.
+    EvalResult tryGradient(const double* vars, double* grad) const {
+        if (!vars && nameCount) return unbound();
+        std::fill(grad, grad + nameCount, 0.0);
+        if (!codeSize) return EvalResult{};
+        Tape t(codeSize, 1);
+        operands(t);
+        for (size_t j = 0; j < codeSize; ++j) {
+            const Instr& in = code[j];
+            if (in.op == Op::Const) { t.val[j] = in.value; continue; }
+            if (in.op == Op::Load) { t.val[j] = vars[in.slot]; continue; }
+            double b = isUnary(in.op) ? 0 : t.val[t.rhs[j]];
+            if (in.op == Op::Div && b == 0) return failure(ErrorCode::DivisionByZero, in.pos);
+            if (in.op == Op::Mod && modByZero(b)) return failure(ErrorCode::ModuloByZero, in.pos);
+            t.val[j] = apply(in, t.val[t.lhs[j]], b);
+        }
+        std::fill(t.adj, t.adj + codeSize - 1, 0.0);
+        t.adj[codeSize - 1] = 1;
+        for (size_t j = codeSize; j-- > 0;) {
+            const Instr& in = code[j];
+            double g = t.adj[j];
+            if (in.op == Op::Load) { grad[in.slot] += g; continue; }
+            if (in.op == Op::Const) continue;
+            bool unary = isUnary(in.op);
+            double da, db;
+            partials(in, t.val[t.lhs[j]], unary ? 0 : t.val[t.rhs[j]], t.val[j], da, db);
+            t.adj[t.lhs[j]] += chain(g, da);
+            if (!unary) t.adj[t.rhs[j]] += chain(g, db);
+        }
+        EvalResult res;
+        res.value = t.val[codeSize - 1];
+        return res;
+    }
+
+    // Forward mode with dual numbers: the value and the derivative along
+    // `direction` (one entry per variable, e.g. a unit vector for a single
+    // partial) in one sweep, into *derivative.
+    EvalResult tryDerivative(const double* vars, const double* direction, double* derivative) const {
+        if (!vars && nameCount) return unbound();
+        struct Dual {
+            double v, d;
+        };
+        Dual small[64];
+        std::vector<Dual> big;
+        Dual* st = small;
+        if (maxDepth > 64) { big.resize(maxDepth); st = big.data(); }
+        size_t sp = 0;
+        for (const Instr& in : instrs()) {
+            if (in.op == Op::Const) { st[sp++] = Dual{in.value, 0}; continue; }
+            if (in.op == Op::Load) { st[sp++] = Dual{vars[in.slot], direction[in.slot]}; continue; }
+            Dual b{0, 0};
+            if (!isUnary(in.op)) b = st[--sp];
+            Dual& a = st[sp - 1];
+            if (in.op == Op::Div && b.v == 0) return failure(ErrorCode::DivisionByZero, in.pos);
+            if (in.op == Op::Mod && modByZero(b.v)) return failure(ErrorCode::ModuloByZero, in.pos);
+            double y = apply(in, a.v, b.v), da, db;
+            partials(in, a.v, b.v, y, da, db);
+            a.d = chain(a.d, da) + chain(b.d, db);
+            a.v = y;
+        }
+        EvalResult res;
+        if (sp) res.value = st[sp - 1].v;
+        *derivative = sp ? st[sp - 1].d : 0;
+        return res;
+    }
+
+    // tryGradient() over columns: out receives the value and grads[i] the
+    // partial by variable i for each row. Values come from the batch kernels
+    // as in tryRunBatch(); the reverse sweep runs a column at a time too.
+    EvalResult tryGradientBatch(const double* const* columns, size_t rows, double* out, double* const* grads) const {
+        if (!columns && nameCount) return unbound();
+        for (size_t i = 0; i < nameCount; ++i) std::fill(grads[i], grads[i] + rows, 0.0);
+        if (!codeSize) { std::fill(out, out + rows, 0.0); return EvalResult{}; }
+        const BatchKernels& k = batchKernels();
+        constexpr size_t chunk = 256;
+        Tape t(codeSize, chunk);
+        operands(t);
+        std::vector<double> tmp(chunk);
+        for (size_t base = 0; base < rows; base += chunk) {
+            size_t n = std::min(chunk, rows - base);
+            auto val = [&](size_t j) { return t.val + j * chunk; };
+            auto adj = [&](size_t j) { return t.adj + j * chunk; };
+            for (size_t j = 0; j < codeSize; ++j) {
+                const Instr& in = code[j];
+                double* y = val(j);
+                if (in.op == Op::Const) { std::fill(y, y + n, in.value); continue; }
+                if (in.op == Op::Load) { memcpy(y, columns[in.slot] + base, n * sizeof(double)); continue; }
+                memcpy(y, val(t.lhs[j]), n * sizeof(double));
+                if (isUnary(in.op)) { unaryBatch(k, in.op, in.value, y, tmp.data(), n); continue; }
+                const double* b = val(t.rhs[j]);
+                switch (in.op) {
+                case Op::Add: k.add(y, b, n); break;
+                case Op::Sub: k.sub(y, b, n); break;
+                case Op::Mul: k.mul(y, b, n); break;
+                case Op::Div:
+                    if (k.div(y, b, n)) return failure(ErrorCode::DivisionByZero, in.pos);
+                    break;
+                default:
+                    for (size_t i = 0; i < n; ++i) {
+                        if (in.op == Op::Mod && modByZero(b[i]))
+                            return failure(ErrorCode::ModuloByZero, in.pos);
+                        y[i] = apply(in, y[i], b[i]);
+                    }
+                    break;
+                }
+            }
+            memcpy(out + base, val(codeSize - 1), n * sizeof(double));
+            std::fill(t.adj, t.adj + codeSize * chunk, 0.0);
+            std::fill(adj(codeSize - 1), adj(codeSize - 1) + n, 1.0);
+            for (size_t j = codeSize; j-- > 0;) {
+                const Instr& in = code[j];
+                const double* g = adj(j);
+                if (in.op == Op::Load) {
+                    double* dst = grads[in.slot] + base;
+                    for (size_t i = 0; i < n; ++i) dst[i] += g[i];
+                    continue;
+                }
+                if (in.op == Op::Const) continue;
+                const double *a = val(t.lhs[j]), *y = val(j);
+                const double* b = isUnary(in.op) ? nullptr : val(t.rhs[j]);
+                double* ga = adj(t.lhs[j]);
+                double* gb = b ? adj(t.rhs[j]) : nullptr;
+                for (size_t i = 0; i < n; ++i) {
+                    double da, db;
+                    partials(in, a[i], b ? b[i] : 0, y[i], da, db);
+                    ga[i] += chain(g[i], da);
+                    if (gb) gb[i] += chain(g[i], db);
+                }
+            }
+        }
+        return EvalResult{};
+    }
+
+private:
+    // Per-instruction values and adjoints (width doubles each) and the
+    // instructions that produced each operand. Like tryRun()'s stack, a short
+    // scalar program's tape lives in fixed storage.
+    struct Tape {
+        double* val;
+        double* adj;
+        uint32_t* lhs;
+        uint32_t* rhs;
+        double smallVals[2 * 64];
+        uint32_t smallIdx[2 * 64];
+        std::vector<double> bigVals;
+        std::vector<uint32_t> bigIdx;
+        Tape(size_t n, size_t width) {
+            double* v = smallVals;
+            uint32_t* ix = smallIdx;
+            if (n * width > 64) { bigVals.resize(2 * n * width); v = bigVals.data(); }
+            if (n > 64) { bigIdx.resize(2 * n); ix = bigIdx.data(); }
+            val = v;
+            adj = v + n * width;
+            lhs = ix;
+            rhs = ix + n;
+        }
+        Tape(const Tape&) = delete;
+        Tape& operator=(const Tape&) = delete;
+    };
+    void operands(Tape& t) const {
+        uint32_t small[64];
+        std::vector<uint32_t> big;
+        uint32_t* st = small;
+        if (maxDepth > 64) { big.resize(maxDepth); st = big.data(); }
+        size_t sp = 0;
+        for (size_t j = 0; j < codeSize; ++j) {
+            Op op = code[j].op;
+            if (op == Op::Const || op == Op::Load) { st[sp++] = static_cast<uint32_t>(j); continue; }
+            if (!isUnary(op)) t.rhs[j] = st[--sp];
+            t.lhs[j] = st[sp - 1];
+            st[sp - 1] = static_cast<uint32_t>(j);
+        }
+    }
+    // The value of a non-leaf instruction, as tryRun() computes it.
+    static double apply(const Instr& in, double a, double b) {
+        switch (in.op) {
+        case Op::Add: return a + b;
+        case Op::Sub: return a - b;
+        case Op::Mul: return a * b;
+        case Op::Div: return a / b;
+        case Op::Mod: return modValues(a, b);
+        case Op::Pow: return std::pow(a, b);
+        default:      return unaryValue(in.op, in.value, a);
+        }
+    }
+    // One term of the chain rule, for the tangent (forward) or adjoint
+    // (reverse) d: 0 if either factor is, so nothing flows through a flat
+    // operand (e.g. either side of %) or from a term that carries nothing,
+    // even when the other factor is inf or NaN.
+    static double chain(double d, double partial) { return d == 0 || partial == 0 ? 0 : d * partial; }
+    // dy/da and dy/db for y = a op b (db is unused for unary ops).
+    static void partials(const Instr& in, double a, double b, double y, double& da, double& db) {
+        db = 0;
+        switch (in.op) {
+        case Op::Neg:    da = -1; break;
+        case Op::Add:    da = 1; db = 1; break;
+        case Op::Sub:    da = 1; db = -1; break;
+        case Op::Mul:    da = b; db = a; break;
+        case Op::Div:    da = 1 / b; db = -y / b; break;
+        case Op::Mod:    da = 0; break;
+        case Op::Pow:    da = b == 0 ? 0 : b * std::pow(a, b - 1); db = y == 0 ? 0 : y * std::log(a); break;
+        case Op::Square: da = 2 * a; break;
+        case Op::Cube:   da = 3 * (a * a); break;
+        case Op::PowInt: da = in.value * powInt(a, static_cast<int>(in.value) - 1); break;
+        case Op::Sqrt:   da = 0.5 / y; break;
+        default:         da = 0; break;
+        }
+    }
+};
+
+class Program {
+    friend class Parser;
+    friend class ProgramSet;
+    friend class NativeCode;
+    friend class ImageWriter;
+    std::vector<Instr> code;
+    std::vector<std::string> names; // slot index -> variable name
+    std::vector<int64_t> bigInts; // exact integer literals beyond 2^53, see Instr::slot
+    size_t maxDepth = 0;
+
+    EvalResult unbound() const { return failure(ErrorCode::UnboundVariable, 0, names[0]); }
+
+public:
+    size_t size() const { return code.size(); }
+    const std::vector<std::string>& variables() const { return names; }
+    int slot(std::string_view name) const {
+        for (size_t i = 0; i < names.size(); ++i)
+            if (names[i] == name) return static_cast<int>(i);
+        return -1;
+    }
+
+    ProgramRef ref() const {
+        return ProgramRef(code.data(), code.size(), bigInts.data(), maxDepth, names.size(),
+                          names.empty() ? std::string_view() : std::string_view(names[0]));
+    }
+
+    // The evaluators, see ProgramRef. vars[i] is the value of variables()[i].
+    double run(const double* vars = nullptr) const { return ref().run(vars); }
+    EvalResult tryRun(const double* vars = nullptr) const { return ref().tryRun(vars); }
+    EvalResult tryRunExact(const double* vars = nullptr) const { return ref().tryRunExact(vars); }
+    void runBatch(const double* const* columns, size_t rows, double* out) const { ref().runBatch(columns, rows, out); }
+    EvalResult tryRunBatch(const double* const* columns, size_t rows, double* out) const {
+        return ref().tryRunBatch(columns, rows, out);
+    }
+    EvalResult tryGradient(const double* vars, double* grad) const { return ref().tryGradient(vars, grad); }
+    EvalResult tryDerivative(const double* vars, const double* direction, double* derivative) const {
+        return ref().tryDerivative(vars, direction, derivative);
+    }
+    EvalResult tryGradientBatch(const double* const* columns, size_t rows, double* out, double* const* grads) const {
+        return ref().tryGradientBatch(columns, rows, out, grads);
+    }
+
+    // Folds constant subexpressions and drops identity operations in place.
+    // In strict mode (the default) only rewrites that are bit-exact under IEEE
+    // 754 are applied: x*1, 1*x, x^1, x-0, x+(-0), -(-x). Relaxed mode also
+    // drops x+0 and x-(-0), which turn a -0 result into +0, and rewrites x^0.5
+    // and other small integer exponents (see powByConstant). Operations that
+    // would fail at run time (division or modulo by zero) are never folded, so
+    // the error still surfaces from run().
+    OptimizeReport optimize(bool strict = true) {
+        struct Val {
+            size_t begin; // first instruction of this operand in `out`
+            bool isConst;
+            double v;
+        };
+        OptimizeReport report;
+        report.before = code.size();
+        std::vector<Instr> out;
+        std::vector<Val> st;
+        out.reserve(code.size());
+        auto isZero = [](double v, bool negative) { return v == 0 && std::signbit(v) == negative; };
+        for (const Instr& in : code) {
+            switch (in.op) {
+            case Op::Const: st.push_back({out.size(), !in.slot, in.value}); out.push_back(in); continue; // keep exact literals
+            case Op::Load:  st.push_back({out.size(), false, 0}); out.push_back(in); continue;
+            case Op::Neg: case Op::Square: case Op::Cube: case Op::PowInt: case Op::Sqrt: {
+                Val& top = st.back();
+                if (top.isConst) { top.v = unaryValue(in.op, in.value, top.v); out.back().value = top.v; }
+                else if (in.op == Op::Neg && out.back().op == Op::Neg) out.pop_back();
+                else out.push_back(in);
+                continue;
+            }
+            default: break;
+            }
+            Val b = st.back(); st.pop_back();
+            Val a = st.back(); st.pop_back();
+            if (a.isConst && b.isConst) {
+                bool folds = true;
+                double r = 0;
+                switch (in.op) {
+                case Op::Add: r = a.v + b.v; break;
+                case Op::Sub: r = a.v - b.v; break;
+                case Op::Mul: r = a.v * b.v; break;
+                case Op::Div: folds = b.v != 0; if (folds) r = a.v / b.v; break;
+                case Op::Mod: folds = !modByZero(b.v); if (folds) r = modValues(a.v, b.v); break;
+                case Op::Pow: r = std::pow(a.v, b.v); break;
+                default: folds = false; break;
+                }
+                if (folds) {
+                    out.resize(a.begin);
+                    out.push_back({Op::Const, r, 0, 0});
+                    st.push_back({a.begin, true, r});
+                    continue;
+                }
+            }
+            bool dropB = b.isConst && ((in.op == Op::Mul && b.v == 1) ||
+                                       (in.op == Op::Pow && b.v == 1) ||
+                                       (in.op == Op::Add && (isZero(b.v, true) || (!strict && b.v == 0))) ||
+                                       (in.op == Op::Sub && (isZero(b.v, false) || (!strict && b.v == 0))));
+            bool dropA = !dropB && a.isConst && ((in.op == Op::Mul && a.v == 1) ||
+                                                 (in.op == Op::Add && (isZero(a.v, true) || (!strict && a.v == 0))));
+            Op special = in.op == Op::Pow && b.isConst ? powByConstant(b.v, strict) : Op::Pow;
+            if (dropB) {
+                out.resize(b.begin);
+                st.push_back(a);
+            } else if (special != Op::Pow) {
+                out.resize(b.begin);
+                out.push_back({special, special == Op::PowInt ? b.v : 0, 0, 0});
+                st.push_back({a.begin, false, 0});
+            } else if (dropA) {
+                out.erase(out.begin() + static_cast<ptrdiff_t>(a.begin));
+                st.push_back({a.begin, false, 0});
+            } else {
+                out.push_back(in);
+                st.push_back({a.begin, false, 0});
+            }
+        }
+        code = std::move(out);
+        // recompute the stack high-water mark for the new code
+        size_t d = 0;
+        maxDepth = 0;
+        for (const Instr& in : code) {
+            if (in.op == Op::Const || in.op == Op::Load) maxDepth = std::max(maxDepth, ++d);
+            else if (!isUnary(in.op)) --d;
+        }
+        report.after = code.size();
+        return report;
+    }
+};
+
+// ---- program images ----
+// Compiled programs saved to one file that is mapped and run in place, so a
+// worker starts with page faults instead of parsing. All offsets are from the
+// start of the file and every array is 8-byte aligned; instructions are the
+// in-memory Instr records themselves. The format is little-endian only: the
+// version word reads as garbage on a big-endian host and the file is refused.
+//
+//     ImageHeader
+//     ImageEntry[count]                   one per program, in the order added
+//     per program: Instr[codeCount], int64_t[bigIntCount], ImageString[nameCount]
+//     string bytes (sources and variable names)
+//
+// Opening checks the whole file once (bounds, opcodes, slots, stack depth),
+// so a truncated or corrupt image is rejected rather than run.
+constexpr uint32_t kImageVersion = 1;
+
+struct ImageString {
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct ImageHeader {
+    char magic[8];      // "CALCIMG\0"
+    uint32_t version;   // kImageVersion
+    uint32_t instrSize; // sizeof(Instr), guards the record layout
+    uint64_t count;     // programs
+    uint64_t entries;   // offset of ImageEntry[count]
+    uint64_t size;      // whole file
+};
+
+struct ImageEntry {
+    uint64_t code;    // Instr[codeCount]
+    uint64_t bigInts; // int64_t[bigIntCount], see Instr::slot
+    uint64_t names;   // ImageString[nameCount], slot order
+    ImageString source;
+    uint32_t codeCount, bigIntCount, nameCount, maxDepth;
+};
+
+static_assert(std::is_trivially_copyable_v<Instr> && sizeof(Instr) == 24 && alignof(Instr) == 8,
+              "Instr is stored as-is in program images");
+
+// Collects programs and writes them as one image.
+class CALC_API ImageWriter {
+    std::vector<Program> progs;
+    std::vector<std::string> sources;
+
+public:
+    void add(const Program& p, std::string_view source = {}) {
+        progs.push_back(p);
+        sources.emplace_back(source);
+    }
+    size_t size() const { return progs.size(); }
+
+    // false with errno set if the file could not be written
+    bool save(const char* path) const;
+};
+
+// A mapped image. Programs are views into the mapping and stay valid for
+// the lifetime of the ProgramImage.
+class CALC_API ProgramImage {
+    const char* base = nullptr;
+    size_t len = 0;
+    const ImageEntry* entries = nullptr;
+    size_t count = 0;
+    const char* err = nullptr;
+
+    bool check();
+    std::string_view str(const ImageString& s) const { return std::string_view(base + s.offset, s.len); }
+    const ImageString* names(size_t i) const { return reinterpret_cast<const ImageString*>(base + entries[i].names); }
+
+public:
+    explicit ProgramImage(const char* path);
+    ~ProgramImage();
+    ProgramImage(const ProgramImage&) = delete;
+    ProgramImage& operator=(const ProgramImage&) = delete;
+
+    bool ok() const { return err == nullptr; }
+    const char* error() const { return err; } // why the image was refused
+    size_t size() const { return count; }
+
+    ProgramRef program(size_t i) const {
+        const ImageEntry& e = entries[i];
+        return ProgramRef(reinterpret_cast<const Instr*>(base + e.code), e.codeCount,
+                          reinterpret_cast<const int64_t*>(base + e.bigInts), e.maxDepth, e.nameCount,
+                          e.nameCount ? str(names(i)[0]) : std::string_view());
+    }
+    std::string_view source(size_t i) const { return str(entries[i].source); }
+    size_t variableCount(size_t i) const { return entries[i].nameCount; }
+    std::string_view variable(size_t i, size_t slot) const { return str(names(i)[slot]); }
+};
+
+// ---- arena ----
+// Bump-pointer allocator for compiled nodes. Memory is handed out from large
+// blocks and only given back all at once by reset(), which also coalesces the
+// blocks into one so a batch of the same shape never grows again.
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> blockSizes;
+    char* cur = nullptr;
+    size_t left = 0;
+    size_t used = 0;
+    size_t grows = 0;
+    size_t capacity = 0;
+
+    void grow(size_t atLeast) {
+        size_t n = std::max(atLeast, blocks.empty() ? size_t(64 << 10) : blockSizes.back() * 2);
+        blocks.emplace_back(new char[n]);
+        blockSizes.push_back(n);
+        cur = blocks.back().get();
+        left = n;
+        capacity += n;
+        ++grows;
+    }
+
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    Arena(Arena&&) = default;
+    Arena& operator=(Arena&&) = default;
+
+    void* allocate(size_t n, size_t align) {
+        size_t pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+        if (!cur || pad + n > left) {
+            grow(n + align);
+            pad = (align - reinterpret_cast<uintptr_t>(cur) % align) % align;
+        }
+        char* p = cur + pad;
+        cur += pad + n;
+        left -= pad + n;
+        used += pad + n;
+        return p;
+    }
+    template <class T>
+    T* allocArray(size_t n) { return static_cast<T*>(allocate(n * sizeof(T), alignof(T))); }
+
+    // Frees everything at once. The next batch starts with a single block as
+    // big as everything this one needed.
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t total = capacity;
+            blocks.clear();
+            blockSizes.clear();
+            capacity = 0;
+            grow(total);
+        } else if (!blocks.empty()) {
+            cur = blocks.back().get();
+            left = blockSizes.back();
+        }
+        used = 0;
+    }
+
+    size_t bytesUsed() const { return used; }
+    size_t bytesReserved() const { return capacity; }
+    size_t growCount() const { return grows; } // block allocations so far
+};
+
+// ---- shared programs ----
+// A hash-consed DAG over many programs. Structurally identical subtrees, within
+// one program or across every program added to the set, become a single node
+// that is computed once per variable binding. Nodes are created children
+// first, so their index order is already a valid schedule: shared nodes always
+// run before the results that depend on them.
+//
+// Errors propagate along operands, left operand first, which matches the order
+// a single program would report them in. A shared Div/Mod node records the
+// source position of the program that introduced it; the others that share
+// it keep their own position on the side, so each result reports exactly what
+// running its program alone would.
+//
+// The set is the compilation context for a batch: nodes and the hash index
+// live in its Arena, nodes contiguous in evaluation order, and clear() drops
+// all of them with one reset. It is a library API: the calc front end streams
+// --batch and --table line by line and does not build one.
+class ProgramSet {
+    struct Node {
+        Op op;
+        uint32_t a = 0, b = 0; // operand node indices
+        uint32_t slot = 0;     // Op::Load, in the set's slot table
+        uint32_t pos = 0;
+        double value = 0;      // Op::Const, Op::PowInt
+    };
+    Arena arena;
+    Node* nodes = nullptr; // arena-backed, nodeCount entries in schedule order
+    size_t nodeCnt = 0, nodeCap = 0;
+    uint32_t* table = nullptr; // open-addressing index: node id + 1, 0 = empty
+    size_t tableCap = 0;       // power of two
+    std::vector<uint32_t> roots;    // result index -> node
+    std::vector<std::string> names;      // shared slot table
+    std::vector<uint32_t> scratch;  // operand stack for add()
+    struct PosFix {
+        uint32_t node, pos;
+    };
+    std::vector<PosFix> fixes;      // per result, Div/Mod nodes it meets first at another pos
+    std::vector<uint32_t> fixBegin; // result index -> its first entry in fixes
+    std::vector<uint32_t> seen;     // add(): Div/Mod nodes of the program so far
+    size_t instrsAdded = 0;
+
+    static uint64_t bitsOf(double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        return bits;
+    }
+    static size_t hashNode(const Node& n) {
+        uint64_t h = bitsOf(n.value) * 0x9E3779B97F4A7C15ull;
+        h ^= (uint64_t(n.a) << 32 | n.b) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+        h ^= (uint64_t(n.slot) << 8 | static_cast<uint8_t>(n.op)) + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
+    static bool sameNode(const Node& x, const Node& y) {
+        return x.op == y.op && x.a == y.a && x.b == y.b && x.slot == y.slot && bitsOf(x.value) == bitsOf(y.value);
+    }
+
+    // Growing moves the nodes to a fresh, bigger run in the arena; the old run
+    // is simply abandoned until the next clear().
+    void reserveNodes(size_t n) {
+        if (n <= nodeCap) return;
+        size_t cap = std::max<size_t>(n, nodeCap ? nodeCap * 2 : 256);
+        Node* fresh = arena.allocArray<Node>(cap);
+        if (nodeCnt) memcpy(fresh, nodes, nodeCnt * sizeof(Node));
+        nodes = fresh;
+        nodeCap = cap;
+    }
+    void rehash(size_t cap) {
+        table = arena.allocArray<uint32_t>(cap);
+        memset(table, 0, cap * sizeof(uint32_t));
+        tableCap = cap;
+        for (size_t i = 0; i < nodeCnt; ++i) {
+            size_t h = hashNode(nodes[i]) & (cap - 1);
+            while (table[h]) h = (h + 1) & (cap - 1);
+            table[h] = static_cast<uint32_t>(i + 1);
+        }
+    }
+
+    uint32_t intern(const Node& n) {
+        if ((nodeCnt + 1) * 2 > tableCap) rehash(tableCap ? tableCap * 2 : 512);
+        size_t h = hashNode(n) & (tableCap - 1);
+        while (uint32_t id = table[h]) {
+            if (sameNode(nodes[id - 1], n)) return id - 1;
+            h = (h + 1) & (tableCap - 1);
+        }
+        reserveNodes(nodeCnt + 1);
+        nodes[nodeCnt] = n;
+        table[h] = static_cast<uint32_t>(++nodeCnt);
+        return static_cast<uint32_t>(nodeCnt - 1);
+    }
+
+    uint32_t slotFor(const std::string& name) {
+        for (size_t i = 0; i < names.size(); ++i)
+            if (names[i] == name) return static_cast<uint32_t>(i);
+        names.push_back(name);
+        return static_cast<uint32_t>(names.size() - 1);
+    }
+
+public:
+    // Adds p and returns its result index. Its variables are matched to the
+    // set's slot table by name.
+    size_t add(const Program& p) {
+        std::vector<uint32_t>& st = scratch;
+        st.clear();
+        seen.clear();
+        fixBegin.push_back(static_cast<uint32_t>(fixes.size()));
+        for (const Instr& in : p.code) {
+            Node n;
+            n.op = in.op;
+            switch (in.op) {
+            case Op::Const: n.value = in.value; break;
+            case Op::Load:  n.slot = slotFor(p.names[in.slot]); break;
+            case Op::Neg: case Op::Square: case Op::Cube: case Op::PowInt: case Op::Sqrt:
+                n.a = st.back(); st.pop_back();
+                n.value = in.value;
+                break;
+            default:
+                n.b = st.back(); st.pop_back();
+                n.a = st.back(); st.pop_back();
+                n.pos = in.pos;
+                break;
+            }
+            uint32_t id = intern(n);
+            if ((n.op == Op::Div || n.op == Op::Mod) && std::find(seen.begin(), seen.end(), id) == seen.end()) {
+                seen.push_back(id); // the program alone would stop at its first use
+                if (nodes[id].pos != n.pos) fixes.push_back({id, n.pos});
+            }
+            st.push_back(id);
+        }
+        instrsAdded += p.code.size();
+        roots.push_back(st.empty() ? intern(Node{Op::Const}) : st.back());
+        return roots.size() - 1;
+    }
+
+    // Drops every program and node; the arena keeps its memory for the next batch.
+    void clear() {
+        arena.reset();
+        nodes = nullptr;
+        nodeCnt = nodeCap = 0;
+        table = nullptr;
+        tableCap = 0;
+        roots.clear();
+        names.clear();
+        fixes.clear();
+        fixBegin.clear();
+        instrsAdded = 0;
+    }
+
+    size_t size() const { return roots.size(); }
+    size_t nodeCount() const { return nodeCnt; }
+    size_t instructionsAdded() const { return instrsAdded; } // before sharing
+    const std::vector<std::string>& variables() const { return names; }
+    const Arena& memory() const { return arena; }
+
+    // One binding: vars[i] is the value of variables()[i], results[i] receives
+    // the outcome of the program added as result index i.
+    void run(const double* vars, EvalResult* results) const {
+        thread_local std::vector<double> val;
+        thread_local std::vector<uint32_t> err; // 0, or 1 + index of the failing node
+        val.resize(nodeCnt);
+        err.assign(nodeCnt, 0);
+        for (size_t i = 0; i < nodeCnt; ++i) {
+            const Node& n = nodes[i];
+            if (n.op != Op::Const && n.op != Op::Load) {
+                uint32_t e = err[n.a];
+                if (!e && !isUnary(n.op)) e = err[n.b];
+                if (e) { err[i] = e; continue; }
+            }
+            double x = val[n.a], y = val[n.b];
+            switch (n.op) {
+            case Op::Const: val[i] = n.value; break;
+            case Op::Load:
+                if (!vars) { err[i] = static_cast<uint32_t>(i + 1); break; }
+                val[i] = vars[n.slot];
+                break;
+            case Op::Neg: val[i] = -x; break;
+            case Op::Add: val[i] = x + y; break;
+            case Op::Sub: val[i] = x - y; break;
+            case Op::Mul: val[i] = x * y; break;
+            case Op::Div:
+                if (y == 0) err[i] = static_cast<uint32_t>(i + 1);
+                else val[i] = x / y;
+                break;
+            case Op::Mod:
+                if (modByZero(y)) err[i] = static_cast<uint32_t>(i + 1);
+                else val[i] = modValues(x, y);
+                break;
+            case Op::Pow: val[i] = std::pow(x, y); break;
+            case Op::Square: case Op::Cube: case Op::PowInt: case Op::Sqrt:
+                val[i] = unaryValue(n.op, n.value, x);
+                break;
+            }
+        }
+        for (size_t r = 0; r < roots.size(); ++r) {
+            uint32_t e = err[roots[r]];
+            results[r] = e ? errorAt(r, e - 1) : EvalResult{};
+            if (!e) results[r].value = val[roots[r]];
+        }
+    }
+
+    // Column form of run(): columns[i] holds variables()[i] for every row and
+    // outs[r] receives result r's column. status[r] reports the first failure
+    // of result r on any row; its column contents are then unspecified.
+    void runBatch(const double* const* columns, size_t rows, double* const* outs, EvalResult* status) const {
+        const BatchKernels& k = batchKernels();
+        constexpr size_t chunk = 256;
+        std::vector<double> cols(std::max<size_t>(nodeCnt, 1) * chunk);
+        std::vector<double> tmp(chunk);
+        std::vector<uint32_t> err(nodeCnt, 0); // sticky across chunks
+        auto col = [&](size_t i) { return cols.data() + i * chunk; };
+        for (size_t base = 0; base < rows; base += chunk) {
+            size_t n = std::min(chunk, rows - base);
+            for (size_t i = 0; i < nodeCnt; ++i) {
+                const Node& nd = nodes[i];
+                if (err[i]) continue; // first failing chunk wins, as in Program::runBatch
+                if (nd.op != Op::Const && nd.op != Op::Load) {
+                    uint32_t e = err[nd.a];
+                    if (!e && !isUnary(nd.op)) e = err[nd.b];
+                    if (e) { err[i] = e; continue; }
+                }
+                double* dst = col(i);
+                const double* x = col(nd.a);
+                const double* y = col(nd.b);
+                switch (nd.op) {
+                case Op::Const: std::fill(dst, dst + n, nd.value); continue;
+                case Op::Load:
+                    if (!columns) { err[i] = static_cast<uint32_t>(i + 1); continue; }
+                    memcpy(dst, columns[nd.slot] + base, n * sizeof(double));
+                    continue;
+                case Op::Neg: for (size_t j = 0; j < n; ++j) dst[j] = -x[j]; continue;
+                default: break;
+                }
+                memcpy(dst, x, n * sizeof(double));
+                switch (nd.op) {
+                case Op::Add: k.add(dst, y, n); break;
+                case Op::Sub: k.sub(dst, y, n); break;
+                case Op::Mul: k.mul(dst, y, n); break;
+                case Op::Div: if (k.div(dst, y, n)) err[i] = static_cast<uint32_t>(i + 1); break;
+                case Op::Mod:
+                    for (size_t j = 0; j < n; ++j) {
+                        if (modByZero(y[j])) { err[i] = static_cast<uint32_t>(i + 1); break; }
+                        dst[j] = modValues(x[j], y[j]);
+                    }
+                    break;
+                case Op::Pow: for (size_t j = 0; j < n; ++j) dst[j] = std::pow(x[j], y[j]); break;
+                case Op::Square: case Op::Cube: case Op::PowInt: case Op::Sqrt:
+                    unaryBatch(k, nd.op, nd.value, dst, tmp.data(), n);
+                    break;
+                default: break;
+                }
+            }
+            for (size_t r = 0; r < roots.size(); ++r)
+                if (!err[roots[r]]) memcpy(outs[r] + base, col(roots[r]), n * sizeof(double));
+        }
+        for (size_t r = 0; r < roots.size(); ++r)
+            status[r] = err[roots[r]] ? errorAt(r, err[roots[r]] - 1) : EvalResult{};
+    }
+
+private:
+    // The failure of result r, which stopped at node.
+    EvalResult errorAt(size_t r, uint32_t node) const {
+        const Node& n = nodes[node];
+        uint32_t pos = n.pos;
+        size_t end = r + 1 < fixBegin.size() ? fixBegin[r + 1] : fixes.size();
+        for (size_t i = fixBegin[r]; i < end; ++i)
+            if (fixes[i].node == node) pos = fixes[i].pos;
+        switch (n.op) {
+        case Op::Div:  return failure(ErrorCode::DivisionByZero, pos);
+        case Op::Mod:  return failure(ErrorCode::ModuloByZero, pos);
+        default:       return failure(ErrorCode::UnboundVariable, 0, names[n.slot]);
+        }
+    }
+};
+
+// ---- native code ----
+// x86-64 code generation for hot programs. Each instruction becomes a few SSE2
+// scalar ops on the value stack, whose first 12 entries live in xmm4..xmm15
+// and the rest in a spill array. pow, % and x^n call the same helpers the
+// interpreter uses, and every other op is the same single IEEE operation, so
+// results are bit-identical to tryRun(), short of which NaN comes out when two
+// meet. Elsewhere (other CPUs, non-SysV ABIs, or if the OS refuses an
+// executable mapping) compile() returns null and callers keep interpreting.
+class CALC_API NativeCode {
+    // returns 0, or 1 + index of the Div/Mod instruction that failed
+    using Fn = uint32_t (*)(const double* vars, const double* consts, double* spill, double* result);
+    struct Asm;
+
+    void* mem = nullptr;
+    size_t len = 0;
+    Fn fn = nullptr;
+    std::vector<double> consts; // [0] -0.0 (sign mask), [1] -inf, [2] +inf, then the literals
+    const Program* prog = nullptr;
+
+    NativeCode() = default;
+    static bool generate(const Program& p, std::vector<double>& pool, Asm& a);
+
+public:
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+    ~NativeCode();
+
+    // Native code for p, which must outlive the result; null where
+    // unsupported. p must not change afterwards (no optimize()).
+    static std::unique_ptr<NativeCode> compile(const Program& p);
+
+    size_t codeSize() const { return len; }
+
+    // Same contract as Program::tryRun.
+    EvalResult tryRun(const double* vars = nullptr) const {
+        if (!vars && !prog->names.empty()) return prog->unbound();
+        double small[64];
+        std::vector<double> big;
+        double* spill = small;
+        if (prog->maxDepth > 64) { big.resize(prog->maxDepth); spill = big.data(); }
+        EvalResult r;
+        if (uint32_t e = fn(vars, consts.data(), spill, &r.value)) {
+            const Instr& in = prog->code[e - 1];
+            return failure(in.op == Op::Div ? ErrorCode::DivisionByZero : ErrorCode::ModuloByZero, in.pos);
+        }
+        return r;
+    }
+};
+
+// Tiered execution: interpreted for the first `threshold` runs, then through
+// NativeCode where available. Not thread-safe; use one per thread.
+class HotProgram {
+    Program prog;
+    size_t threshold;
+    size_t runs = 0;
+    std::unique_ptr<NativeCode> native;
+
+public:
+    explicit HotProgram(Program p, size_t threshold = 10000) : prog(std::move(p)), threshold(threshold) {}
+    HotProgram(const HotProgram&) = delete;
+    HotProgram& operator=(const HotProgram&) = delete;
+
+    const Program& program() const { return prog; }
+    bool isNative() const { return native != nullptr; }
+
+    double run(const double* vars = nullptr) {
+        EvalResult r = tryRun(vars);
+        if (!r.ok()) throw CalcError(r);
+        return r.value;
+    }
+    EvalResult tryRun(const double* vars = nullptr) {
+        if (native) return native->tryRun(vars);
+        if (runs <= threshold && runs++ == threshold) {
+            native = NativeCode::compile(prog);
+            if (native) return native->tryRun(vars);
+        }
+        return prog.tryRun(vars);
+    }
+};
+
+// ---- lexer ----
+// One pass over the input turns it into a flat token array. Whitespace is
+// skipped exactly once, "**" is folded into Caret, and literals are converted
+// up front, so the grammar below never looks at raw bytes again.
+enum class Tok : uint8_t {
+    Number, Ident, Plus, Minus, Star, Slash, Percent, Caret, LParen, RParen,
+    BadNumber,  // looked like a number but did not convert
+    HugeNumber, // converted but out of range
+    Invalid,    // any other byte
+    End,
+};
+
+// Run scanners for the lexer: each returns how many of the first n bytes of
+// s are in its class, classifying 16, 32 or 64 bytes per step (SSE2, AVX2,
+// AVX-512BW or NEON) and finishing the tail a byte at a time. Classes are
+// ASCII, the same bytes isspace/isdigit/isalnum accept in the "C" locale.
+struct LexKernels {
+    const char* isa;
+    size_t (*spaces)(const char* s, size_t n); // ' ', \t \n \v \f \r
+    size_t (*digits)(const char* s, size_t n); // 0-9
+    size_t (*ident)(const char* s, size_t n);  // letters, digits and '_'
+};
+
+CALC_API const LexKernels& lexKernels(); // picked once from the running CPU
+
+struct Token {
+    Tok kind;
+    uint32_t offset; // byte offset into the source
+    union {
+        double number; // Tok::Number
+        uint32_t len;  // Tok::Ident
+    };
+};
+
+class Lexer {
+public:
+    static constexpr bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+    static constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static constexpr bool isIdentStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    static constexpr bool isIdentChar(char c) { return isIdentStart(c) || isDigit(c); }
+
+    // Replaces out with the tokens of s, always terminated by Tok::End. Stops
+    // early, returning false, at a token past maxTokens; the End token then
+    // carries that token's offset.
+    static bool tokenize(std::string_view s, std::vector<Token>& out, size_t maxTokens = SIZE_MAX) {
+        out.clear();
+        const LexKernels& k = lexKernels();
+        size_t pos = 0, n = s.size();
+        while (true) {
+            pos = skipRun(s, pos, isSpace, k.spaces);
+            Token t;
+            t.kind = Tok::End;
+            t.offset = static_cast<uint32_t>(pos);
+            t.number = 0;
+            if (pos == n) { out.push_back(t); return true; }
+            if (out.size() == maxTokens) { out.push_back(t); return false; }
+            char c = s[pos];
+            switch (c) {
+            case '+': t.kind = Tok::Plus; ++pos; break;
+            case '-': t.kind = Tok::Minus; ++pos; break;
+            case '/': t.kind = Tok::Slash; ++pos; break;
+            case '%': t.kind = Tok::Percent; ++pos; break;
+            case '^': t.kind = Tok::Caret; ++pos; break;
+            case '(': t.kind = Tok::LParen; ++pos; break;
+            case ')': t.kind = Tok::RParen; ++pos; break;
+            case '*':
+                if (pos + 1 < n && s[pos + 1] == '*') { t.kind = Tok::Caret; pos += 2; }
+                else { t.kind = Tok::Star; ++pos; }
+                break;
+            default:
+                if (isDigit(c) || c == '.') {
+                    pos = lexNumber(s, pos, t, k);
+                } else if (isIdentStart(c)) {
+                    size_t start = pos;
+                    pos = skipRun(s, pos + 1, isIdentChar, k.ident);
+                    t.kind = Tok::Ident;
+                    t.len = static_cast<uint32_t>(pos - start);
+                } else {
+                    t.kind = Tok::Invalid;
+                    ++pos;
+                }
+            }
+            out.push_back(t);
+        }
+    }
+
+private:
+    // End of the run of `in` bytes starting at s[pos]. Most runs are a few
+    // bytes (one space, a short number), so the first 8 are checked inline;
+    // only a longer run is handed to the kernel.
+    static size_t skipRun(std::string_view s, size_t pos, bool (*in)(char), size_t (*kernel)(const char*, size_t)) {
+        size_t n = s.size(), limit = std::min(n, pos + 8);
+        while (pos < limit && in(s[pos])) ++pos;
+        if (pos == limit && pos < n) pos += kernel(s.data() + pos, n - pos);
+        return pos;
+    }
+
+    // Clinger's fast path, as in ConstParser::number(): a significand up to
+    // 2^53 times or divided by an exact power of ten is one correctly rounded
+    // operation, so it is the double from_chars would give. [p, end) is a
+    // literal as lexNumber() scanned it; false leaves it to from_chars.
+    static bool fastNumber(const char* p, const char* end, double& v) {
+        static constexpr double kPow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        uint64_t m = 0;
+        int digits = 0, exp10 = 0;
+        bool afterDot = false;
+        for (; p < end && *p != 'e' && *p != 'E'; ++p) {
+            if (*p == '.') { afterDot = true; continue; }
+            if (++digits > 19) return false; // before m can overflow
+            m = m * 10 + static_cast<uint64_t>(*p - '0');
+            exp10 -= afterDot;
+        }
+        if (!digits || m > (uint64_t(1) << 53)) return false;
+        if (p < end) {
+            bool negative = *++p == '-';
+            if (*p == '+' || *p == '-') ++p;
+            int e = 0;
+            for (; p < end; ++p)
+                if ((e = e * 10 + (*p - '0')) > 400) return false;
+            exp10 += negative ? -e : e;
+        }
+        if (m == 0) { v = 0; return true; }
+        if (exp10 < -22 || exp10 > 22) return false;
+        v = exp10 < 0 ? static_cast<double>(m) / kPow10[-exp10] : static_cast<double>(m) * kPow10[exp10];
+        return true;
+    }
+
+    // integer/float with optional scientific notation, e.g. 3.5, .5, 1e-3
+    static size_t lexNumber(std::string_view s, size_t pos, Token& t, const LexKernels& k) {
+        size_t start = pos, n = s.size();
+        pos = skipRun(s, pos, isDigit, k.digits);
+        if (pos < n && s[pos] == '.') pos = skipRun(s, pos + 1, isDigit, k.digits);
+        if (pos < n && (s[pos] == 'e' || s[pos] == 'E')) {
+            size_t save = pos++;
+            if (pos < n && (s[pos] == '+' || s[pos] == '-')) ++pos;
+            size_t digits = pos;
+            pos = skipRun(s, pos, isDigit, k.digits);
+            if (pos == digits) pos = save; // roll back if not a valid exponent
+        }
+        double v = 0;
+        if (fastNumber(s.data() + start, s.data() + pos, v)) {
+            t.kind = Tok::Number;
+            t.number = v;
+            return pos;
+        }
+        // from_chars is locale-independent and works on the view in place
+        auto [end, ec] = std::from_chars(s.data() + start, s.data() + pos, v);
+        if (ec == std::errc::result_out_of_range) t.kind = Tok::HugeNumber;
+        else if (ec != std::errc() || end != s.data() + pos) t.kind = Tok::BadNumber;
+        else { t.kind = Tok::Number; t.number = v; }
+        return pos;
+    }
+};
+
+// ---- budgets ----
+// Per-expression limits for services that take input from untrusted callers
+// (0 = unlimited). Each is checked where the work happens and fails with its
+// own error code as soon as it is exceeded, before the rest of the input is
+// looked at.
+struct Limits {
+    size_t inputBytes = 0; // source length, checked before lexing
+    size_t tokens = 0;     // tokens, not counting the end of input
+    size_t depth = 0;      // parser nesting: '(', unary signs, '^' towers (not other operators)
+    size_t steps = 0;      // program instructions; a run executes each one once
+};
+
+// Parses a view over a caller-owned buffer, which must outlive compile()/parse().
+class Parser {
+public:
+    // Precedence is the default: an operator-precedence loop with an explicit
+    // stack, so nesting depth costs heap, not native stack. Recursive is the
+    // original recursive-descent grammar, kept as the reference implementation.
+    enum class Engine { Precedence, Recursive };
+
+private:
+    // Operator stack entry for the precedence engine.
+    struct StackOp {
+        Op op;          // Add/Sub/Mul/Div/Mod/Pow; Neg / Const for a pending unary minus / plus
+        bool paren;     // '(' marker
+        uint32_t at;    // source offset, for Div/Mod errors
+    };
+
+    std::string_view expr;
+    std::vector<Token> toks;
+    size_t cur = 0; // index into toks
+    Program prog;
+    size_t depth = 0;
+    EvalResult status; // first syntax error, if any
+    Engine engine = Engine::Precedence;
+    std::vector<StackOp> ops; // precedence engine operator stack, reused across inputs
+    bool lexed = false;  // toks holds the tokens of expr
+    bool truncated = false; // lex() stopped at a budget; toks is cut short
+    Limits limits;
+    size_t nest = 0; // open '(', sign and '^' levels, against limits.depth
+
+public:
+    // vars pre-assigns slots so several expressions can share one value array;
+    // identifiers not listed get the next free slot in order of appearance.
+    explicit Parser(std::string_view s, std::vector<std::string> vars = {}) : expr(s) {
+        prog.names = std::move(vars);
+    }
+
+    // Point the parser at new input, keeping the token and program buffers'
+    // capacity so a long-lived Parser stops allocating once it has seen its
+    // largest input.
+    void reset(std::string_view s) {
+        expr = s;
+        cur = 0;
+        depth = 0;
+        status = EvalResult{};
+        prog.code.clear();
+        prog.names.clear();
+        prog.bigInts.clear();
+        prog.maxDepth = 0;
+        lexed = false;
+        truncated = false;
+    }
+
+    // Tokenize the current input without compiling it (e.g. to build a cache
+    // key); a following tryCompile() reuses these tokens.
+    const std::vector<Token>& lex() {
+        if (lexed) return toks;
+        lexed = true;
+        if (limits.inputBytes && expr.size() > limits.inputBytes) {
+            Lexer::tokenize({}, toks);
+            truncated = true;
+            fail(ErrorCode::InputTooLong, limits.inputBytes);
+        } else if (!Lexer::tokenize(expr, toks, limits.tokens ? limits.tokens : SIZE_MAX)) {
+            truncated = true;
+            fail(ErrorCode::TooManyTokens, toks.back().offset);
+        }
+        return toks;
+    }
+    // The input was over the length or token budget, so lex() did not see all
+    // of it; compiling fails with that error.
+    bool lexTruncated() const { return truncated; }
+    std::string_view source() const { return expr; }
+
+    // Compile the whole input into a reusable Program; syntax errors throw here,
+    // arithmetic errors (division/modulo by zero) throw from Program::run().
+    Program compile() {
+        EvalResult r = tryCompile();
+        if (!r.ok()) throw CalcError(r);
+        return std::move(prog);
+    }
+    double parse() {
+        EvalResult r = tryParse();
+        if (!r.ok()) throw CalcError(r);
+        return r.value;
+    }
+
+    // Non-throwing forms. tryCompile leaves the result in program(), replacing
+    // whatever an earlier call left there (variable slots are kept).
+    EvalResult tryCompile() {
+        prog.code.clear();
+        prog.bigInts.clear();
+        prog.maxDepth = 0;
+        lex();
+        if (truncated) return status; // lex() recorded the budget error
+        status = EvalResult{};
+        cur = 0;
+        depth = 0;
+        nest = 0;
+        if (engine == Engine::Precedence) {
+            parseIterative();
+            return status;
+        }
+        parseExpression();
+        if (failed()) return status;
+        if (peek().kind != Tok::End) return failure(ErrorCode::TrailingInput, peek().offset);
+        return status;
+    }
+    EvalResult tryParse() {
+        EvalResult r = tryCompile();
+        return r.ok() ? prog.tryRun() : r;
+    }
+    EvalResult tryParseExact() {
+        EvalResult r = tryCompile();
+        return r.ok() ? prog.tryRunExact() : r;
+    }
+    const Program& program() const { return prog; }
+    OptimizeReport optimize(bool strict = true) { return prog.optimize(strict); }
+    void setEngine(Engine e) { engine = e; }
+    // Budgets for every following input; they survive reset().
+    void setLimits(const Limits& l) { limits = l; }
+    const Limits& currentLimits() const { return limits; }
+
+private:
+    bool failed() const { return !status.ok(); }
+    void fail(ErrorCode code, size_t at) {
+        if (!failed()) status = failure(code, at);
+    }
+
+    // ---- utilities ----
+    const Token& peek() const { return toks[cur]; }
+    bool match(Tok k) {
+        if (toks[cur].kind != k) return false;
+        ++cur;
+        return true;
+    }
+    bool nextStartsFactor() const {
+        // Start of a factor is: '(' or a number or an identifier
+        // (We intentionally do NOT treat '+' or '-' as implicit multiply starters.)
+        switch (peek().kind) {
+        case Tok::LParen: case Tok::Number: case Tok::Ident:
+        case Tok::BadNumber: case Tok::HugeNumber:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void emit(Op op, double value = 0, uint32_t slot = 0, size_t at = 0) {
+        if (op == Op::Pow) {
+            // x^2 with a literal exponent: one multiply instead of pow()
+            Instr& e = prog.code.back();
+            Op special = e.op == Op::Const && !e.slot ? powByConstant(e.value, true) : Op::Pow;
+            if (special != Op::Pow) {
+                e = {special, 0, 0, static_cast<uint32_t>(at)};
+                --depth;
+                return;
+            }
+        }
+        if (limits.steps && prog.code.size() >= limits.steps) {
+            fail(ErrorCode::TooManySteps, peek().offset);
+            return;
+        }
+        prog.code.push_back({op, value, slot, static_cast<uint32_t>(at)});
+        if (op == Op::Const || op == Op::Load) {
+            if (++depth > prog.maxDepth) prog.maxDepth = depth;
+        } else if (!isUnary(op)) {
+            --depth; // binary ops pop two, push one
+        }
+    }
+
+    // ---- precedence engine ----
+    // Accepts exactly the grammar below: unary +/- bind to the next primary
+    // (so -2^2 == 4), '^' is right-associative, and a factor start in operator
+    // position is an implicit '*'. Errors are reported at the same token the
+    // recursive engine would stop at.
+    static int precedence(Op op) {
+        switch (op) {
+        case Op::Add: case Op::Sub: return 1;
+        case Op::Mul: case Op::Div: case Op::Mod: return 2;
+        case Op::Pow: return 3;
+        default: return 0;
+        }
+    }
+
+    void pushBinary(Op op, uint32_t at) {
+        int p = precedence(op);
+        bool rightAssoc = (op == Op::Pow);
+        while (!ops.empty() && !ops.back().paren) {
+            int q = precedence(ops.back().op);
+            if (q < p || (q == p && rightAssoc)) break;
+            emit(ops.back().op, 0, 0, ops.back().at);
+            popOp();
+        }
+        pushOp({op, false, at});
+    }
+
+    // '(' markers, signs and '^' count against limits.depth while they are on
+    // the stack, exactly as long as the recursive engine's enter() holds them.
+    static bool nests(const StackOp& op) { return op.paren || op.op == Op::Neg || op.op == Op::Const || op.op == Op::Pow; }
+    bool pushOp(StackOp op) {
+        if (nests(op)) {
+            if (limits.depth && nest >= limits.depth) {
+                fail(ErrorCode::NestingTooDeep, op.at);
+                return false;
+            }
+            ++nest;
+        }
+        ops.push_back(op);
+        return true;
+    }
+    void popOp() {
+        nest -= nests(ops.back());
+        ops.pop_back();
+    }
+
+    // A primary (or parenthesized group) just finished: apply pending signs.
+    void closePrimary() {
+        while (!ops.empty() && !ops.back().paren && (ops.back().op == Op::Neg || ops.back().op == Op::Const)) {
+            if (ops.back().op == Op::Neg) emit(Op::Neg);
+            popOp();
+        }
+    }
+
+    void parseIterative() {
+        ops.clear();
+        size_t open = 0; // '(' markers on the stack
+        bool expectOperand = true;
+        while (!failed()) { // only a budget fails mid-loop
+            const Token& t = peek();
+            if (expectOperand) {
+                switch (t.kind) {
+                case Tok::Plus:   ++cur; pushOp({Op::Const, false, t.offset}); break; // emits nothing
+                case Tok::Minus:  ++cur; pushOp({Op::Neg, false, t.offset}); break;
+                case Tok::LParen: ++cur; pushOp({Op::Add, true, t.offset}); ++open; break;
+                case Tok::Number:
+                    ++cur;
+                    emitNumber(t);
+                    closePrimary();
+                    expectOperand = false;
+                    break;
+                case Tok::Ident:
+                    ++cur;
+                    emit(Op::Load, 0, slotFor(expr.substr(t.offset, t.len)));
+                    closePrimary();
+                    expectOperand = false;
+                    break;
+                case Tok::HugeNumber: fail(ErrorCode::NumberOutOfRange, t.offset); return;
+                default:              fail(ErrorCode::ExpectedNumber, t.offset); return;
+                }
+                continue;
+            }
+            // pending operators are emitted before stepping past the next
+            // token, which is where the recursive engine emits them
+            switch (t.kind) {
+            case Tok::Plus:    pushBinary(Op::Add, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::Minus:   pushBinary(Op::Sub, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::Star:    pushBinary(Op::Mul, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::Slash:   pushBinary(Op::Div, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::Percent: pushBinary(Op::Mod, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::Caret:   pushBinary(Op::Pow, t.offset); ++cur; expectOperand = true; continue;
+            case Tok::RParen:
+                if (open == 0) break; // unmatched ')' ends the expression
+                while (!ops.back().paren) {
+                    emit(ops.back().op, 0, 0, ops.back().at);
+                    popOp();
+                }
+                popOp();
+                ++cur;
+                --open;
+                closePrimary();
+                continue;
+            default:
+                if (nextStartsFactor()) {
+                    // implicit multiplication: e.g., 2(3+4) or (1+2)(3+4) or 3.5(2)
+                    pushBinary(Op::Mul, t.offset);
+                    expectOperand = true;
+                    continue;
+                }
+                break;
+            }
+            // end of the expression: anything left must be End at top level
+            if (open > 0) { fail(ErrorCode::MissingParen, t.offset); return; }
+            if (t.kind != Tok::End) { fail(ErrorCode::TrailingInput, t.offset); return; }
+            while (!ops.empty()) {
+                emit(ops.back().op, 0, 0, ops.back().at);
+                popOp();
+            }
+            return;
+        }
+    }
+
+    // ---- recursive engine ----
+    // expression := term (('+'|'-') term)*
+    void parseExpression() {
+        parseTerm();
+        while (!failed()) {
+            if (match(Tok::Plus))       { parseTerm(); emit(Op::Add); }
+            else if (match(Tok::Minus)) { parseTerm(); emit(Op::Sub); }
+            else break;
+        }
+    }
+
+    // term := power ( ( '*' | '/' | '%' | implicitMul ) power )*
+    // implicitMul occurs when another factor begins without an explicit operator
+    void parseTerm() {
+        parsePower();
+        while (!failed()) {
+            size_t at = peek().offset;
+            if (match(Tok::Star)) {
+                parsePower(); emit(Op::Mul);
+            } else if (match(Tok::Slash)) {
+                parsePower(); emit(Op::Div, 0, 0, at);
+            } else if (match(Tok::Percent)) {
+                parsePower(); emit(Op::Mod, 0, 0, at);
+            } else if (nextStartsFactor()) {
+                // implicit multiplication: e.g., 2(3+4) or (1+2)(3+4) or 3.5(2)
+                parsePower(); emit(Op::Mul);
+            } else {
+                break;
+            }
+        }
+    }
+
+    // power := factor ( ('^' | '**') power )?
+    // Right-associative: a^b^c == a^(b^c)
+    void parsePower() {
+        parseFactor();
+        if (failed()) return;
+        size_t at = peek().offset;
+        if (match(Tok::Caret)) {
+            if (!enter(at)) return;
+            parsePower(); // recurse for right-assoc
+            --nest;
+            emit(Op::Pow);
+        }
+    }
+
+    // One level of recursion below a sign, '(' or '^', against limits.depth.
+    bool enter(size_t at) {
+        if (limits.depth && nest >= limits.depth) {
+            fail(ErrorCode::NestingTooDeep, at);
+            return false;
+        }
+        ++nest;
+        return true;
+    }
+
+    // factor := number | identifier | '(' expression ')' | unary ('+'|'-') factor
+    void parseFactor() {
+        const Token& t = peek();
+        switch (t.kind) {
+        case Tok::Plus: // unary plus
+            ++cur;
+            if (enter(t.offset)) { parseFactor(); --nest; }
+            return;
+        case Tok::Minus: // unary minus
+            ++cur;
+            if (!enter(t.offset)) return;
+            parseFactor();
+            --nest;
+            emit(Op::Neg);
+            return;
+        case Tok::LParen:
+            ++cur;
+            if (!enter(t.offset)) return;
+            parseExpression();
+            --nest;
+            if (!failed() && !match(Tok::RParen)) fail(ErrorCode::MissingParen, peek().offset);
+            return;
+        case Tok::Ident:
+            ++cur;
+            emit(Op::Load, 0, slotFor(expr.substr(t.offset, t.len)));
+            return;
+        case Tok::Number:
+            ++cur;
+            emitNumber(t);
+            return;
+        case Tok::HugeNumber:
+            fail(ErrorCode::NumberOutOfRange, t.offset);
+            return;
+        default:
+            fail(ErrorCode::ExpectedNumber, t.offset);
+            return;
+        }
+    }
+
+    // Integer literals past 2^53 also keep their exact int64 value for tryRunExact().
+    void emitNumber(const Token& t) {
+        uint32_t exactSlot = 0;
+        if (std::fabs(t.number) >= 9007199254740992.0) {
+            size_t end = t.offset;
+            while (end < expr.size() && Lexer::isDigit(expr[end])) ++end;
+            int64_t v;
+            bool digitsOnly = end == expr.size() || (expr[end] != '.' && expr[end] != 'e' && expr[end] != 'E');
+            auto [ptr, ec] = std::from_chars(expr.data() + t.offset, expr.data() + end, v);
+            if (digitsOnly && ec == std::errc() && ptr == expr.data() + end) {
+                prog.bigInts.push_back(v);
+                exactSlot = static_cast<uint32_t>(prog.bigInts.size());
+            }
+        }
+        emit(Op::Const, t.number, exactSlot);
+    }
+
+    uint32_t slotFor(std::string_view name) {
+        int s = prog.slot(name);
+        if (s >= 0) return static_cast<uint32_t>(s);
+        prog.names.emplace_back(name);
+        return static_cast<uint32_t>(prog.names.size() - 1);
+    }
+};
+
+// ---- constant expressions ----
+// calc::eval folds a literal expression at compile time with the same grammar
+// and results as Parser:
+//
+//     constexpr double k = calc::eval("3.5(2)+1e-3");
+//
+// It works anywhere a constant expression does (constexpr variables,
+// static_assert, consteval functions); called at run time it is just
+// Parser(src).parse(). Compile-time folding only accepts what provably gives
+// the same bits as the run-time path: literals on the exact fast path (at most
+// 2^53 significand, power of ten within 1e22) and '^' with an exact integer
+// result. Anything else, like any syntax or arithmetic error, fails to compile
+// at the call to notConstant() or raise() below.
+//
+// CALC_FORMULA turns a literal with variables into a function object whose
+// call is plain inlined arithmetic, with no parse at run time:
+//
+//     constexpr auto total = CALC_FORMULA("price*qty*(1+tax)");
+//     double t = total(price, qty, tax); // arguments in order of first use
+#if defined(__cpp_lib_is_constant_evaluated)
+#define CALC_CONSTANT_EVALUATED() std::is_constant_evaluated()
+#elif (defined(__clang__) && __clang_major__ >= 9) || (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 9)
+#define CALC_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#else
+#define CALC_CONSTANT_EVALUATED() true // cannot tell: always take the constexpr path
+#endif
+
+[[noreturn]] inline void raise(ErrorCode code, size_t pos, std::string_view detail = {}) {
+    throw CalcError(failure(code, pos, detail));
+}
+[[noreturn]] inline void notConstant(size_t pos) {
+    throw std::logic_error("calc: not a compile-time constant at position " + std::to_string(pos));
+}
+
+struct ConstNode {
+    Op op = Op::Const;
+    uint32_t a = 0, b = 0; // operand node indices; for Op::Load, a is the slot
+    uint32_t pos = 0;      // source offset of the operator, for Div/Mod errors
+    double value = 0;      // Op::Const
+};
+
+// Nodes in postfix order: operands always come before the node using them.
+template <size_t Cap>
+struct ConstTree {
+    ConstNode nodes[Cap] = {};
+    size_t count = 0;
+    std::string_view names[Cap] = {}; // slot -> variable name, in order of first use
+    size_t nameCount = 0;
+    uint32_t root = 0;
+};
+
+// The recursive engine's grammar over raw bytes, usable in constexpr. Cap
+// bounds the node count; 2 * length + 1 always suffices ("1x" is three nodes).
+template <size_t Cap>
+class ConstParser {
+    struct Lexeme {
+        Tok kind;
+        size_t start, end;
+    };
+
+    std::string_view s;
+    size_t pos = 0;
+    ConstTree<Cap> t;
+
+public:
+    constexpr explicit ConstParser(std::string_view src) : s(src) {}
+
+    constexpr ConstTree<Cap> parse() {
+        t.root = expression();
+        Lexeme end = peek();
+        if (end.kind != Tok::End) raise(ErrorCode::TrailingInput, end.start);
+        return t;
+    }
+
+private:
+    static constexpr bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static constexpr bool isIdentStart(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_'; }
+    static constexpr bool isIdentChar(char c) { return isIdentStart(c) || isDigit(c); }
+    static constexpr bool isSpace(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+    // Same tokens as Lexer; numbers are only scanned here and converted by number().
+    constexpr Lexeme peek() const {
+        size_t p = pos, n = s.size();
+        while (p < n && isSpace(s[p])) ++p;
+        if (p == n) return {Tok::End, p, p};
+        switch (s[p]) {
+        case '+': return {Tok::Plus, p, p + 1};
+        case '-': return {Tok::Minus, p, p + 1};
+        case '/': return {Tok::Slash, p, p + 1};
+        case '%': return {Tok::Percent, p, p + 1};
+        case '^': return {Tok::Caret, p, p + 1};
+        case '(': return {Tok::LParen, p, p + 1};
+        case ')': return {Tok::RParen, p, p + 1};
+        case '*': return p + 1 < n && s[p + 1] == '*' ? Lexeme{Tok::Caret, p, p + 2} : Lexeme{Tok::Star, p, p + 1};
+        default: break;
+        }
+        size_t e = p;
+        if (isDigit(s[p]) || s[p] == '.') {
+            bool seenDot = false;
+            while (e < n && (isDigit(s[e]) || (s[e] == '.' && !seenDot))) seenDot |= s[e++] == '.';
+            if (e < n && (s[e] == 'e' || s[e] == 'E')) {
+                size_t x = e + 1;
+                if (x < n && (s[x] == '+' || s[x] == '-')) ++x;
+                if (x < n && isDigit(s[x])) {
+                    while (x < n && isDigit(s[x])) ++x;
+                    e = x;
+                }
+            }
+            return {Tok::Number, p, e};
+        }
+        if (isIdentStart(s[p])) {
+            while (e < n && isIdentChar(s[e])) ++e;
+            return {Tok::Ident, p, e};
+        }
+        return {Tok::Invalid, p, p + 1};
+    }
+
+    // Clinger's fast path: an integer significand below 2^53 times or divided
+    // by an exact power of ten is one correctly rounded operation, so it is
+    // the same double from_chars produces.
+    constexpr double number(const Lexeme& tok) const {
+        constexpr uint64_t limit = uint64_t(1) << 53;
+        uint64_t m = 0;
+        int exp10 = 0;
+        bool digits = false, afterDot = false;
+        size_t p = tok.start;
+        for (; p < tok.end && s[p] != 'e' && s[p] != 'E'; ++p) {
+            if (s[p] == '.') { afterDot = true; continue; }
+            digits = true;
+            m = m * 10 + static_cast<uint64_t>(s[p] - '0');
+            if (m > limit) notConstant(tok.start);
+            if (afterDot) --exp10;
+        }
+        if (!digits) raise(ErrorCode::ExpectedNumber, tok.start); // Tok::BadNumber
+        if (p < tok.end) {
+            bool negative = s[++p] == '-';
+            if (s[p] == '+' || s[p] == '-') ++p;
+            int e = 0;
+            for (; p < tok.end; ++p) e = std::min(e * 10 + (s[p] - '0'), 100000);
+            exp10 += negative ? -e : e;
+        }
+        if (m == 0) return 0;
+        if (exp10 < -22 || exp10 > 22) notConstant(tok.start);
+        double scale = 1;
+        for (int i = 0; i < (exp10 < 0 ? -exp10 : exp10); ++i) scale *= 10;
+        return exp10 < 0 ? static_cast<double>(m) / scale : static_cast<double>(m) * scale;
+    }
+
+    constexpr uint32_t add(const ConstNode& n) {
+        if (t.count == Cap) notConstant(n.pos);
+        t.nodes[t.count] = n;
+        return static_cast<uint32_t>(t.count++);
+    }
+    constexpr uint32_t slotFor(std::string_view name) {
+        for (size_t i = 0; i < t.nameCount; ++i)
+            if (t.names[i] == name) return static_cast<uint32_t>(i);
+        t.names[t.nameCount] = name;
+        return static_cast<uint32_t>(t.nameCount++);
+    }
+
+    constexpr uint32_t expression() {
+        uint32_t a = term();
+        while (true) {
+            Lexeme op = peek();
+            if (op.kind != Tok::Plus && op.kind != Tok::Minus) return a;
+            pos = op.end;
+            uint32_t b = term();
+            a = add({op.kind == Tok::Plus ? Op::Add : Op::Sub, a, b});
+        }
+    }
+
+    constexpr uint32_t term() {
+        uint32_t a = power();
+        while (true) {
+            Lexeme op = peek();
+            Op o = Op::Mul;
+            switch (op.kind) {
+            case Tok::Star:    pos = op.end; break;
+            case Tok::Slash:   pos = op.end; o = Op::Div; break;
+            case Tok::Percent: pos = op.end; o = Op::Mod; break;
+            case Tok::LParen: case Tok::Number: case Tok::Ident: break; // implicit '*'
+            default: return a;
+            }
+            uint32_t b = power();
+            a = add({o, a, b, static_cast<uint32_t>(op.start)});
+        }
+    }
+
+    constexpr uint32_t power() {
+        uint32_t a = factor();
+        Lexeme op = peek();
+        if (op.kind != Tok::Caret) return a;
+        pos = op.end;
+        uint32_t b = power();
+        return add({Op::Pow, a, b});
+    }
+
+    constexpr uint32_t factor() {
+        Lexeme tok = peek();
+        switch (tok.kind) {
+        case Tok::Plus:
+            pos = tok.end;
+            return factor();
+        case Tok::Minus: {
+            pos = tok.end;
+            uint32_t a = factor();
+            return add({Op::Neg, a});
+        }
+        case Tok::LParen: {
+            pos = tok.end;
+            uint32_t e = expression();
+            Lexeme close = peek();
+            if (close.kind != Tok::RParen) raise(ErrorCode::MissingParen, close.start);
+            pos = close.end;
+            return e;
+        }
+        case Tok::Ident:
+            pos = tok.end;
+            return add({Op::Load, slotFor(s.substr(tok.start, tok.end - tok.start))});
+        case Tok::Number: {
+            ConstNode n;
+            n.value = number(tok);
+            pos = tok.end;
+            return add(n);
+        }
+        default:
+            raise(ErrorCode::ExpectedNumber, tok.start);
+        }
+    }
+};
+
+// x^y at compile time, only where pow() is known to return the exact result.
+// x^2 with a literal exponent is x*x, as Parser emits it.
+constexpr double constPow(double x, double y, bool literalTwo, size_t pos) {
+    constexpr double limit = 9007199254740992.0; // 2^53
+    if (literalTwo) return x * x;
+    if (y == 0) return 1;
+    if (y == 1) return x;
+    if (y > 0 && y <= 64 && y == static_cast<double>(static_cast<int>(y))) {
+        int e = static_cast<int>(y);
+        if (x == 0) return e % 2 ? x : 0.0; // keeps -0 for odd powers
+        if (x > -limit && x < limit && x == static_cast<double>(static_cast<int64_t>(x))) {
+            double acc = 1;
+            for (int i = 0; i < e && acc > -limit && acc < limit; ++i) acc *= x;
+            if (acc > -limit && acc < limit) return acc; // every product was an exact integer
+        }
+    }
+    notConstant(pos);
+}
+
+template <size_t Cap>
+constexpr double fold(const ConstTree<Cap>& t) {
+    if (t.nameCount) raise(ErrorCode::UnboundVariable, 0, t.names[0]);
+    double val[Cap] = {};
+    for (size_t i = 0; i < t.count; ++i) {
+        const ConstNode& n = t.nodes[i];
+        double x = val[n.a], y = val[n.b];
+        switch (n.op) {
+        case Op::Const: val[i] = n.value; break;
+        case Op::Neg:   val[i] = -x; break;
+        case Op::Add:   val[i] = x + y; break;
+        case Op::Sub:   val[i] = x - y; break;
+        case Op::Mul:   val[i] = x * y; break;
+        case Op::Div:
+            if (y == 0) raise(ErrorCode::DivisionByZero, n.pos);
+            val[i] = x / y;
+            break;
+        case Op::Mod:
+            if (modByZero(y)) raise(ErrorCode::ModuloByZero, n.pos);
+            val[i] = modValues(x, y);
+            break;
+        case Op::Pow:
+            val[i] = constPow(x, y, t.nodes[n.b].op == Op::Const && y == 2, n.pos);
+            break;
+        default: break;
+        }
+    }
+    return val[t.root];
+}
+
+constexpr double eval(std::string_view src) {
+    if (!CALC_CONSTANT_EVALUATED()) return Parser(src).parse();
+    return fold(ConstParser<512>(src).parse());
+}
+template <size_t N>
+constexpr double eval(const char (&src)[N]) {
+    if (!CALC_CONSTANT_EVALUATED()) return Parser(src).parse();
+    return fold(ConstParser<2 * N + 1>(src).parse());
+}
+
+// Src::text() returns the expression; see CALC_FORMULA. The tree is built at
+// compile time and each node becomes one instantiation of at<>(), so a call
+// compiles to the arithmetic itself. Errors match Program::run().
+template <class Src>
+class Formula {
+    static constexpr auto tree = ConstParser<2 * Src::text().size() + 1>(Src::text()).parse();
+
+    template <uint32_t I>
+    static double at(const double* v) {
+        constexpr ConstNode n = tree.nodes[I];
+        if constexpr (n.op == Op::Const) {
+            return n.value;
+        } else if constexpr (n.op == Op::Load) {
+            return v[n.a];
+        } else if constexpr (n.op == Op::Neg) {
+            return -at<n.a>(v);
+        } else if constexpr (n.op == Op::Pow && tree.nodes[n.b].op == Op::Const && tree.nodes[n.b].value == 2) {
+            double x = at<n.a>(v);
+            return x * x;
+        } else {
+            double x = at<n.a>(v), y = at<n.b>(v);
+            if constexpr (n.op == Op::Add) return x + y;
+            if constexpr (n.op == Op::Sub) return x - y;
+            if constexpr (n.op == Op::Mul) return x * y;
+            if constexpr (n.op == Op::Div) {
+                if (y == 0) raise(ErrorCode::DivisionByZero, n.pos);
+                return x / y;
+            }
+            if constexpr (n.op == Op::Mod) {
+                if (modByZero(y)) raise(ErrorCode::ModuloByZero, n.pos);
+                return modValues(x, y);
+            }
+            if constexpr (n.op == Op::Pow) return std::pow(x, y);
+        }
+    }
+
+public:
+    static constexpr size_t arity = tree.nameCount;
+    static constexpr std::string_view variable(size_t i) { return tree.names[i]; }
+
+    // vars[i] is the value of variable(i)
+    double operator()(const double* vars) const { return at<tree.root>(vars); }
+
+    template <class... Args, class = std::enable_if_t<(std::is_arithmetic_v<Args> && ...)>>
+    double operator()(Args... args) const {
+        static_assert(sizeof...(Args) == arity, "one argument per variable, in order of first use");
+        const double vars[sizeof...(Args) + 1] = {static_cast<double>(args)...};
+        return at<tree.root>(vars);
+    }
+};
+
+
+#define CALC_FORMULA(literal) \
+    ([] { \
+        struct Src { static constexpr std::string_view text() { return literal; } }; \
+        return calc::Formula<Src>{}; \
+    }())
+
+// ---- result cache ----
+// Bounded LRU cache from a normalized token stream to its EvalResult, errors
+// included. Inputs that differ only in whitespace share an entry when parsed
+// under the same Limits; the limits are part of the key, since a depth or step
+// budget can turn a success into an error and back. Error
+// positions and unbound-variable names are stored as token indices and mapped
+// back onto the caller's own input, so a hit reports exactly what a fresh
+// parse would. Keys hash to one of several independently locked shards so
+// worker threads rarely contend.
+class ResultCache {
+    struct Entry {
+        std::string key;
+        double value;
+        ErrorCode error;
+        int32_t posTok;    // token whose offset is the error position, or -1
+        int32_t detailTok; // Ident token naming the unbound variable, or -1
+    };
+    struct Shard {
+        std::mutex m;
+        std::list<Entry> lru; // most recently used first
+        std::unordered_map<std::string_view, std::list<Entry>::iterator> map; // keys view into lru
+        size_t bytes = 0;
+        size_t hits = 0, misses = 0;
+    };
+    static constexpr size_t entryOverhead = sizeof(Entry) + 64; // list node + map bucket, roughly
+
+    std::vector<std::unique_ptr<Shard>> shards;
+    size_t shardCap;
+
+    static void appendKey(std::string& key, const Limits& limits, const std::vector<Token>& toks,
+                          std::string_view src) {
+        const size_t budgets[] = {limits.inputBytes, limits.tokens, limits.depth, limits.steps};
+        key.assign(reinterpret_cast<const char*>(budgets), sizeof(budgets));
+        for (const Token& t : toks) {
+            key.push_back(static_cast<char>(t.kind));
+            if (t.kind == Tok::Number) key.append(reinterpret_cast<const char*>(&t.number), sizeof(t.number));
+            else if (t.kind == Tok::Ident) { key.append(src.substr(t.offset, t.len)); key.push_back('\0'); }
+        }
+    }
+    static int32_t tokenAt(const std::vector<Token>& toks, size_t pos) {
+        auto it = std::lower_bound(toks.begin(), toks.end(), pos,
+                                   [](const Token& t, size_t p) { return t.offset < p; });
+        return (it != toks.end() && it->offset == pos) ? static_cast<int32_t>(it - toks.begin()) : -1;
+    }
+
+public:
+    // capBytes bounds keys plus per-entry overhead across all shards.
+    explicit ResultCache(size_t capBytes, size_t shardCount = 16) {
+        shardCount = std::max<size_t>(shardCount, 1);
+        for (size_t i = 0; i < shardCount; ++i) shards.push_back(std::make_unique<Shard>());
+        shardCap = std::max<size_t>(capBytes / shardCount, entryOverhead);
+    }
+
+    // Evaluates p's current input, consulting the cache first.
+    EvalResult evaluate(Parser& p) {
+        thread_local std::string key;
+        const std::vector<Token>& toks = p.lex();
+        if (p.lexTruncated()) return p.tryParse(); // the tokens are cut short, so they are no key
+        std::string_view src = p.source();
+        appendKey(key, p.currentLimits(), toks, src);
+        Shard& sh = *shards[std::hash<std::string_view>()(key) % shards.size()];
+        {
+            std::lock_guard<std::mutex> lk(sh.m);
+            auto it = sh.map.find(key);
+            if (it != sh.map.end()) {
+                ++sh.hits;
+                sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+                const Entry& e = *it->second;
+                EvalResult r;
+                r.value = e.value;
+                r.error = e.error;
+                if (e.posTok >= 0) r.pos = toks[static_cast<size_t>(e.posTok)].offset;
+                if (e.detailTok >= 0) {
+                    const Token& t = toks[static_cast<size_t>(e.detailTok)];
+                    r.detail = src.substr(t.offset, t.len);
+                }
+                return r;
+            }
+            ++sh.misses;
+        }
+        EvalResult r = p.tryParse();
+        Entry e{key, r.value, r.error, -1, -1};
+        if (r.error == ErrorCode::UnboundVariable) { // pos is 0 then, not a token's offset
+            for (size_t i = 0; i < toks.size(); ++i)
+                if (toks[i].kind == Tok::Ident && src.substr(toks[i].offset, toks[i].len) == r.detail) {
+                    e.detailTok = static_cast<int32_t>(i);
+                    break;
+                }
+        } else if (!r.ok()) {
+            e.posTok = tokenAt(toks, r.pos);
+        }
+        size_t cost = key.size() + entryOverhead;
+        if (cost > shardCap) return r;
+        std::lock_guard<std::mutex> lk(sh.m);
+        if (sh.map.count(key)) return r; // another thread got here first
+        sh.lru.push_front(std::move(e));
+        sh.map.emplace(sh.lru.front().key, sh.lru.begin());
+        sh.bytes += cost;
+        while (sh.bytes > shardCap) {
+            Entry& victim = sh.lru.back();
+            sh.bytes -= victim.key.size() + entryOverhead;
+            sh.map.erase(victim.key);
+            sh.lru.pop_back();
+        }
+        return r;
+    }
+
+    struct Stats {
+        size_t hits = 0, misses = 0, entries = 0, bytes = 0;
+    };
+    Stats stats() {
+        Stats s;
+        for (auto& sh : shards) {
+            std::lock_guard<std::mutex> lk(sh->m);
+            s.hits += sh->hits;
+            s.misses += sh->misses;
+            s.entries += sh->lru.size();
+            s.bytes += sh->bytes;
+        }
+        return s;
+    }
+};
+
+// ---- metrics ----
+// Log-linear latency histogram in the manner of HdrHistogram: values below 16
+// get a bucket each, and every power of two above is split into 16 equal
+// sub-buckets, so any recorded value is within 1/16 (6.25%) of its bucket's
+// bounds over the full 64-bit range.
+class LatencyHistogram {
+public:
+    static constexpr unsigned kSubBits = 4;
+    static constexpr size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    static size_t bucketOf(uint64_t v) {
+        if (v < (1u << kSubBits)) return static_cast<size_t>(v);
+        unsigned e = 63 - static_cast<unsigned>(__builtin_clzll(v));
+        return ((e - kSubBits + 1) << kSubBits) + ((v >> (e - kSubBits)) & ((1u << kSubBits) - 1));
+    }
+    static uint64_t lowest(size_t b) { // smallest value in bucket b
+        if (b < (1u << kSubBits)) return b;
+        unsigned e = static_cast<unsigned>(b >> kSubBits) + kSubBits - 1;
+        return (uint64_t(1) << e) + (uint64_t(b & ((1u << kSubBits) - 1)) << (e - kSubBits));
+    }
+    static uint64_t highest(size_t b) { return b + 1 < kBuckets ? lowest(b + 1) - 1 : UINT64_MAX; }
+
+    // One writer per histogram: plain relaxed load/store, no read-modify-write.
+    void record(uint64_t v) {
+        bump(counts[bucketOf(v)], 1);
+        bump(sum, v);
+        if (v > max.load(std::memory_order_relaxed)) max.store(v, std::memory_order_relaxed);
+    }
+
+    struct Snapshot {
+        std::vector<uint64_t> counts = std::vector<uint64_t>(kBuckets);
+        uint64_t total = 0, sum = 0, max = 0;
+
+        // Upper bound of the bucket holding the q-quantile (capped at max).
+        uint64_t quantile(double q) const {
+            if (!total) return 0;
+            uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total - 1)) + 1, seen = 0;
+            for (size_t b = 0; b < kBuckets; ++b)
+                if ((seen += counts[b]) >= rank) return std::min(highest(b), max);
+            return max;
+        }
+    };
+    // Safe against a concurrent writer; the result may lag it slightly.
+    void addTo(Snapshot& s) const {
+        for (size_t b = 0; b < kBuckets; ++b) {
+            uint64_t c = counts[b].load(std::memory_order_relaxed);
+            s.counts[b] += c;
+            s.total += c;
+        }
+        s.sum += sum.load(std::memory_order_relaxed);
+        s.max = std::max(s.max, max.load(std::memory_order_relaxed));
+    }
+
+private:
+    std::atomic<uint64_t> counts[kBuckets] = {};
+    std::atomic<uint64_t> sum{0}, max{0};
+
+    static void bump(std::atomic<uint64_t>& a, uint64_t by) {
+        a.store(a.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+};
+
+// Per-phase latency and per-outcome counts. Each recording thread gets a shard
+// of its own on first use, so recording takes no lock and shares no cache
+// line; only snapshots walk all shards. Callers that don't want metrics pass
+// no Metrics at all and pay nothing.
+class Metrics {
+public:
+    enum Phase { Parse, Compile, Eval, kPhases }; // lexing, bytecode generation, running
+    static constexpr size_t kOutcomes = kErrorCodes;
+
+private:
+    struct alignas(64) Shard {
+        std::thread::id owner;
+        LatencyHistogram phases[kPhases];
+        std::atomic<uint64_t> outcomes[kOutcomes] = {};
+    };
+    const uint64_t id;
+    mutable std::mutex m; // guards shards (not their contents)
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> n{0};
+        return ++n;
+    }
+
+    Shard& local() {
+        thread_local uint64_t cachedId = 0;
+        thread_local Shard* cached = nullptr;
+        if (cachedId == id) return *cached;
+        std::lock_guard<std::mutex> lk(m);
+        Shard* s = nullptr;
+        for (auto& sh : shards)
+            if (sh->owner == std::this_thread::get_id()) s = sh.get();
+        if (!s) {
+            shards.push_back(std::make_unique<Shard>());
+            s = shards.back().get();
+            s->owner = std::this_thread::get_id();
+        }
+        cachedId = id;
+        cached = s;
+        return *s;
+    }
+
+public:
+    Metrics() : id(nextId()) {}
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    void record(Phase p, uint64_t ns) { local().phases[p].record(ns); }
+    // One finished expression, ok or not.
+    void count(ErrorCode e) {
+        std::atomic<uint64_t>& c = local().outcomes[static_cast<size_t>(e)];
+        c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    LatencyHistogram::Snapshot snapshot(Phase p) const {
+        LatencyHistogram::Snapshot s;
+        std::lock_guard<std::mutex> lk(m);
+        for (auto& sh : shards) sh->phases[p].addTo(s);
+        return s;
+    }
+    uint64_t outcomes(ErrorCode e) const {
+        uint64_t n = 0;
+        std::lock_guard<std::mutex> lk(m);
+        for (auto& sh : shards) n += sh->outcomes[static_cast<size_t>(e)].load(std::memory_order_relaxed);
+        return n;
+    }
+};
+
+// ---- eval pool ----
+// A fixed set of worker threads draining one FIFO of (function, argument)
+// jobs, for Session's waves, the async entry points below and the calc front
+// end's --threads: work handed to it never costs a thread of its own. Jobs
+// must not throw: the ones here catch what evaluation throws (bad_alloc) and
+// hand it to the thread waiting for them. The destructor runs what is still
+// queued, then joins.
+class CALC_API EvalPool {
+public:
+    explicit EvalPool(unsigned threads = 0); // 0: one per hardware thread
+    ~EvalPool();
+    EvalPool(const EvalPool&) = delete;
+    EvalPool& operator=(const EvalPool&) = delete;
+
+    void post(void (*fn)(void*), void* arg);
+    unsigned size() const { return static_cast<unsigned>(workers.size()); }
+
+private:
+    struct Job {
+        void (*fn)(void*);
+        void* arg;
+    };
+    std::mutex m;
+    std::condition_variable ready;
+    std::deque<Job> jobs;
+    bool stopping = false;
+    std::vector<std::thread> workers;
+
+    void work();
+};
+
+// ---- sessions ----
+// A set of named formulas that refer to each other ("a = b*2", "c = a^2 + d")
+// and are kept up to date incrementally. Names that are referenced but never
+// defined are inputs, given values with set(). Changing a formula or an input
+// marks only its downstream nodes dirty, and recompute() re-evaluates just
+// those, dependencies first. Nodes whose dependencies are all up to date form
+// a wave; the nodes of a wave are independent and are spread over `threads`
+// threads (the caller and an EvalPool the Session keeps) when the wave is
+// large enough to pay for it.
+//
+// A node whose dependency failed takes on that failure; an unset input reads
+// as UnboundVariable. Not thread-safe: one thread drives a Session.
+//
+// If evaluation throws (bad_alloc, on any thread), recompute() rethrows it
+// once the wave is done. The nodes it had not finished stay dirty, and the
+// next call picks them up.
+class CALC_API Session {
+public:
+    struct RecomputeReport {
+        size_t recomputed = 0; // nodes evaluated by this call
+        size_t waves = 0;      // dependency levels among them
+    };
+
+    explicit Session(unsigned threads = 1) : threads(threads ? threads : 1) {}
+
+    // Defines or replaces name as formula. Fails on a syntax error or if the
+    // formula would make name depend on itself; the previous definition stays.
+    EvalResult define(std::string_view name, std::string_view formula);
+    // "name = formula"
+    EvalResult assign(std::string_view line);
+    // Gives name a value, making it an input (replacing any formula).
+    void set(std::string_view name, double value);
+
+    RecomputeReport recompute();
+
+    // The last computed result; call recompute() first for pending changes.
+    EvalResult value(std::string_view name) const;
+    bool dirty() const { return !pending.empty(); }
+    size_t size() const { return nodes.size(); }
+    size_t totalRecomputed() const { return total; }
+
+private:
+    struct Node {
+        std::string name;
+        Program prog;         // empty for inputs
+        bool input = true;
+        bool hasValue = false; // inputs: set() was called
+        std::vector<uint32_t> deps;  // node of each variable slot of prog
+        std::vector<uint32_t> users; // nodes whose formulas read this one
+        EvalResult result;
+        bool dirty = false;
+        uint32_t waiting = 0; // recompute(): dirty dependencies not yet done
+    };
+    std::deque<Node> nodes; // stable addresses: results' detail may point at a name
+    std::unordered_map<std::string, uint32_t> ids;
+    std::vector<uint32_t> pending; // dirty nodes, in no particular order
+    unsigned threads;
+    std::unique_ptr<EvalPool> pool; // threads - 1 workers, started by the first wide wave
+    size_t total = 0;
+
+    uint32_t node(std::string_view name);
+    void markDirty(uint32_t id);
+    bool reaches(uint32_t id, const std::vector<uint32_t>& deps) const;
+    void evaluate(Node& n) const;
+};
+
+#if CALC_HAS_COROUTINES
+// ---- async evaluation ----
+// Awaitables for C++20 coroutines (the rest of the engine is C++17, so this
+// part only exists when the includer compiles as C++20):
+//
+//     EvalResult r = co_await evalAsync(pool, request);
+//     co_await evalBatchAsync(pool, exprs, n, results);
+//
+// Input shorter than offloadBytes is evaluated inline by await_ready(), with
+// no suspension: for typical expressions that is cheaper than any hand-off.
+// Longer input runs on the pool, and the coroutine resumes on the pool thread
+// that finished it (a service that wants its I/O thread back reschedules
+// itself there). A batch is split by bytes into up to pool.size() parts and
+// resumes once, after the last part. An exception thrown while evaluating on
+// the pool (bad_alloc) is rethrown by the co_await, the first one for a
+// batch. Source text must outlive the co_await, and a result's detail views
+// the caller's source, not engine storage.
+struct AsyncOptions {
+    size_t offloadBytes = 16 << 10; // inline below this much input (per batch: in total)
+    Limits limits;                  // applied to every expression
+};
+
+// Evaluates src with a parser kept per thread, so neither path allocates once
+// warm.
+inline EvalResult evaluateOn(std::string_view src, const Limits& limits) {
+    thread_local Parser p("");
+    p.reset(src);
+    p.setLimits(limits);
+    EvalResult r = p.tryParse();
+    // detail views p's name storage, which the next call on this thread
+    // overwrites. It can only be the unbound names[0], the first identifier,
+    // so point it at that token of src instead (as ResultCache does).
+    if (r.error == ErrorCode::UnboundVariable) {
+        for (const Token& t : p.lex())
+            if (t.kind == Tok::Ident) { r.detail = src.substr(t.offset, t.len); break; }
+    }
+    return r;
+}
+
+class EvalAwaitable {
+public:
+    EvalAwaitable(EvalPool& pool, std::string_view src, const AsyncOptions& opt) : pool(pool), src(src), opt(opt) {}
+
+    bool await_ready() {
+        if (src.size() >= opt.offloadBytes) return false;
+        result = evaluateOn(src, opt.limits);
+        return true;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        pool.post(run, this); // may resume (and destroy *this) before post returns
+    }
+    EvalResult await_resume() const {
+        if (error) std::rethrow_exception(error);
+        return result;
+    }
+
+private:
+    EvalPool& pool;
+    std::string_view src;
+    AsyncOptions opt;
+    EvalResult result;
+    std::exception_ptr error;
+    std::coroutine_handle<> waiter;
+
+    static void run(void* self) {
+        auto* a = static_cast<EvalAwaitable*>(self);
+        try {
+            a->result = evaluateOn(a->src, a->opt.limits);
+        } catch (...) {
+            a->error = std::current_exception();
+        }
+        a->waiter.resume();
+    }
+};
+
+// out[i] receives the result of srcs[i].
+class BatchAwaitable {
+public:
+    BatchAwaitable(EvalPool& pool, const std::string_view* srcs, size_t n, EvalResult* out, const AsyncOptions& opt)
+        : pool(pool), srcs(srcs), n(n), out(out), opt(opt) {}
+
+    bool await_ready() {
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; ++i) bytes += srcs[i].size();
+        if (n == 0 || bytes < opt.offloadBytes) {
+            for (size_t i = 0; i < n; ++i) out[i] = evaluateOn(srcs[i], opt.limits);
+            return true;
+        }
+        size_t count = std::min<size_t>(std::max(pool.size(), 1u), n), share = bytes / count, begin = 0, acc = 0;
+        for (size_t i = 0; i < n; ++i) {
+            acc += srcs[i].size();
+            if (acc >= share * (parts.size() + 1) && parts.size() + 1 < count) {
+                parts.push_back({this, begin, i + 1});
+                begin = i + 1;
+            }
+        }
+        parts.push_back({this, begin, n});
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        pending.store(parts.size(), std::memory_order_relaxed);
+        // the last part to finish resumes the coroutine, which may destroy
+        // *this while this loop is still posting: use locals only
+        EvalPool* p = &pool;
+        Part* first = parts.data();
+        size_t count = parts.size();
+        for (size_t i = 0; i < count; ++i) p->post(run, first + i);
+    }
+    void await_resume() const {
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    struct Part {
+        BatchAwaitable* owner;
+        size_t begin, end;
+    };
+    EvalPool& pool;
+    const std::string_view* srcs;
+    size_t n;
+    EvalResult* out;
+    AsyncOptions opt;
+    std::vector<Part> parts;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr error; // the first part's to throw, published by pending
+    std::coroutine_handle<> waiter;
+
+    static void run(void* arg) {
+        Part& part = *static_cast<Part*>(arg);
+        BatchAwaitable* b = part.owner;
+        try {
+            for (size_t i = part.begin; i < part.end; ++i) b->out[i] = evaluateOn(b->srcs[i], b->opt.limits);
+        } catch (...) {
+            if (!b->failed.exchange(true, std::memory_order_relaxed)) b->error = std::current_exception();
+        }
+        if (b->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) b->waiter.resume();
+    }
+};
+
+inline EvalAwaitable evalAsync(EvalPool& pool, std::string_view src, const AsyncOptions& opt = {}) {
+    return EvalAwaitable(pool, src, opt);
+}
+inline BatchAwaitable evalBatchAsync(EvalPool& pool, const std::string_view* srcs, size_t n, EvalResult* out,
+                                     const AsyncOptions& opt = {}) {
+    return BatchAwaitable(pool, srcs, n, out, opt);
+}
+#endif
+
+} // namespace calc
+
+#endif // CALC_HPP
@@ -0,0 +1,952 @@
+// libcalc.cpp - the compiled part of the engine: the CPU-specific batch and
+// lexer kernels, native code generation, program images, sessions, the eval
+// pool and the C interface declared in calc.h.
+#include "calc.hpp"
+
+#include <new>
+#include <cerrno>
+#include <cstddef>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+namespace calc {
+
+// ---- batch kernels ----
+#define CALC_SCALAR_KERNEL(name, op) \
+    static void name(double* a, const double* b, size_t n) { \
+        for (size_t i = 0; i < n; ++i) a[i] op b[i]; \
+    }
+CALC_SCALAR_KERNEL(addScalar, +=)
+CALC_SCALAR_KERNEL(subScalar, -=)
+CALC_SCALAR_KERNEL(mulScalar, *=)
+static bool divScalar(double* a, const double* b, size_t n) {
+    bool zero = false;
+    for (size_t i = 0; i < n; ++i) { zero |= (b[i] == 0); a[i] /= b[i]; }
+    return zero;
+}
+static void sqrtScalar(double* a, size_t n) {
+    for (size_t i = 0; i < n; ++i) a[i] = powHalf(a[i]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CALC_AVX_KERNEL(name, isa, width, load, store, fn, op) \
+    __attribute__((target(isa))) static void name(double* a, const double* b, size_t n) { \
+        size_t i = 0; \
+        for (; i + width <= n; i += width) store(a + i, fn(load(a + i), load(b + i))); \
+        for (; i < n; ++i) a[i] op b[i]; \
+    }
+CALC_AVX_KERNEL(addAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +=)
+CALC_AVX_KERNEL(subAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -=)
+CALC_AVX_KERNEL(mulAvx2, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *=)
+CALC_AVX_KERNEL(addAvx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, +=)
+CALC_AVX_KERNEL(subAvx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, -=)
+CALC_AVX_KERNEL(mulAvx512, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, *=)
+
+__attribute__((target("avx2"))) static bool divAvx2(double* a, const double* b, size_t n) {
+    __m256d zero = _mm256_setzero_pd(), bad = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_loadu_pd(b + i);
+        bad = _mm256_or_pd(bad, _mm256_cmp_pd(d, zero, _CMP_EQ_OQ));
+        _mm256_storeu_pd(a + i, _mm256_div_pd(_mm256_loadu_pd(a + i), d));
+    }
+    return _mm256_movemask_pd(bad) != 0 || divScalar(a + i, b + i, n - i);
+}
+__attribute__((target("avx512f"))) static bool divAvx512(double* a, const double* b, size_t n) {
+    __m512d zero = _mm512_setzero_pd();
+    __mmask8 bad = 0;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d d = _mm512_loadu_pd(b + i);
+        bad |= _mm512_cmp_pd_mask(d, zero, _CMP_EQ_OQ);
+        _mm512_storeu_pd(a + i, _mm512_div_pd(_mm512_loadu_pd(a + i), d));
+    }
+    return bad != 0 || divScalar(a + i, b + i, n - i);
+}
+__attribute__((target("avx2"))) static void sqrtAvx2(double* a, size_t n) {
+    __m256d ninf = _mm256_set1_pd(-INFINITY), inf = _mm256_set1_pd(INFINITY), zero = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_loadu_pd(a + i);
+        __m256d r = _mm256_add_pd(_mm256_sqrt_pd(x), zero);
+        _mm256_storeu_pd(a + i, _mm256_blendv_pd(r, inf, _mm256_cmp_pd(x, ninf, _CMP_EQ_OQ)));
+    }
+    sqrtScalar(a + i, n - i);
+}
+__attribute__((target("avx512f"))) static void sqrtAvx512(double* a, size_t n) {
+    __m512d ninf = _mm512_set1_pd(-INFINITY), inf = _mm512_set1_pd(INFINITY), zero = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m512d x = _mm512_loadu_pd(a + i);
+        __m512d r = _mm512_add_pd(_mm512_maskz_sqrt_pd(0xFF, x), zero); // maskz: GCC 12 warns on the unmasked form
+        _mm512_storeu_pd(a + i, _mm512_mask_blend_pd(_mm512_cmp_pd_mask(x, ninf, _CMP_EQ_OQ), r, inf));
+    }
+    sqrtScalar(a + i, n - i);
+}
+#elif defined(__aarch64__)
+#define CALC_NEON_KERNEL(name, fn, op) \
+    static void name(double* a, const double* b, size_t n) { \
+        size_t i = 0; \
+        for (; i + 2 <= n; i += 2) vst1q_f64(a + i, fn(vld1q_f64(a + i), vld1q_f64(b + i))); \
+        for (; i < n; ++i) a[i] op b[i]; \
+    }
+CALC_NEON_KERNEL(addNeon, vaddq_f64, +=)
+CALC_NEON_KERNEL(subNeon, vsubq_f64, -=)
+CALC_NEON_KERNEL(mulNeon, vmulq_f64, *=)
+static bool divNeon(double* a, const double* b, size_t n) {
+    uint64x2_t bad = vdupq_n_u64(0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t d = vld1q_f64(b + i);
+        bad = vorrq_u64(bad, vceqzq_f64(d));
+        vst1q_f64(a + i, vdivq_f64(vld1q_f64(a + i), d));
+    }
+    return (vgetq_lane_u64(bad, 0) | vgetq_lane_u64(bad, 1)) != 0 || divScalar(a + i, b + i, n - i);
+}
+static void sqrtNeon(double* a, size_t n) {
+    float64x2_t ninf = vdupq_n_f64(-INFINITY), inf = vdupq_n_f64(INFINITY), zero = vdupq_n_f64(0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t x = vld1q_f64(a + i);
+        float64x2_t r = vaddq_f64(vsqrtq_f64(x), zero);
+        vst1q_f64(a + i, vbslq_f64(vceqq_f64(x, ninf), inf, r));
+    }
+    sqrtScalar(a + i, n - i);
+}
+#endif
+
+const BatchKernels& batchKernels() {
+    static const BatchKernels k = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx512f"))
+            return BatchKernels{"avx512", addAvx512, subAvx512, mulAvx512, divAvx512, sqrtAvx512};
+        if (__builtin_cpu_supports("avx2"))
+            return BatchKernels{"avx2", addAvx2, subAvx2, mulAvx2, divAvx2, sqrtAvx2};
+#elif defined(__aarch64__)
+        return BatchKernels{"neon", addNeon, subNeon, mulNeon, divNeon, sqrtNeon};
+#endif
+        return BatchKernels{"scalar", addScalar, subScalar, mulScalar, divScalar, sqrtScalar};
+    }();
+    return k;
+}
+
+// ---- lexer kernels ----
+namespace {
+enum LexClass { Spaces, Digits, Ident };
+
+template <LexClass C>
+constexpr bool inClass(char c) {
+    return C == Spaces ? Lexer::isSpace(c) : C == Digits ? Lexer::isDigit(c) : Lexer::isIdentChar(c);
+}
+
+template <LexClass C>
+size_t runScalar(const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && inClass<C>(s[i])) ++i;
+    return i;
+}
+} // namespace
+
+#if defined(__x86_64__) || defined(__i386__)
+// One kernel per ISA: V is the vector type, gt/eq compare into a mask that
+// both/either combine, bits turns it into an integer. Bytes compare as signed,
+// so anything >= 0x80 is below every range and never matches; x in [lo, hi]
+// is lo - 1 < x < hi + 1.
+#define CALC_LEX_KERNEL(name, isa, width, V, load, set1, gt, eq, both, either, lower, bits, tail)                   \
+    template <LexClass C>                                                                                           \
+    __attribute__((target(isa))) size_t name(const char* s, size_t n) {                                             \
+        size_t i = 0;                                                                                               \
+        for (; i + width <= n; i += width) {                                                                        \
+            V v = load(s + i), low = lower(v);                                                                      \
+            auto digit = both(gt(v, set1('0' - 1)), gt(set1('9' + 1), v));                                          \
+            auto m = C == Digits ? digit                                                                            \
+                   : C == Spaces ? either(eq(v, set1(' ')), both(gt(v, set1('\t' - 1)), gt(set1('\r' + 1), v)))     \
+                   : either(either(both(gt(low, set1('a' - 1)), gt(set1('z' + 1), low)), digit), eq(v, set1('_'))); \
+            uint64_t miss = ~static_cast<uint64_t>(bits(m)) & (~0ull >> (64 - width));                              \
+            if (miss) return i + static_cast<size_t>(__builtin_ctzll(miss));                                        \
+        }                                                                                                           \
+        return i + tail<C>(s + i, n - i);                                                                           \
+    }
+#define CALC_LOAD128(p) _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))
+#define CALC_LOAD256(p) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))
+#define CALC_LOWER128(v) _mm_or_si128(v, _mm_set1_epi8(0x20))
+#define CALC_LOWER256(v) _mm256_or_si256(v, _mm256_set1_epi8(0x20))
+#define CALC_LOWER512(v) _mm512_or_si512(v, _mm512_set1_epi8(0x20))
+#define CALC_MOVEMASK128(m) static_cast<uint32_t>(_mm_movemask_epi8(m))
+#define CALC_MOVEMASK256(m) static_cast<uint32_t>(_mm256_movemask_epi8(m))
+#define CALC_MASK_AND(a, b) ((a) & (b))
+#define CALC_MASK_OR(a, b) ((a) | (b))
+#define CALC_MASK_BITS(m) (m)
+CALC_LEX_KERNEL(runSse2, "sse2", 16, __m128i, CALC_LOAD128, _mm_set1_epi8, _mm_cmpgt_epi8, _mm_cmpeq_epi8,
+                _mm_and_si128, _mm_or_si128, CALC_LOWER128, CALC_MOVEMASK128, runScalar)
+CALC_LEX_KERNEL(runAvx2, "avx2", 32, __m256i, CALC_LOAD256, _mm256_set1_epi8, _mm256_cmpgt_epi8, _mm256_cmpeq_epi8,
+                _mm256_and_si256, _mm256_or_si256, CALC_LOWER256, CALC_MOVEMASK256, runSse2)
+CALC_LEX_KERNEL(runAvx512, "avx512bw", 64, __m512i, _mm512_loadu_si512, _mm512_set1_epi8, _mm512_cmpgt_epi8_mask,
+                _mm512_cmpeq_epi8_mask, CALC_MASK_AND, CALC_MASK_OR, CALC_LOWER512, CALC_MASK_BITS, runAvx2)
+#elif defined(__aarch64__)
+template <LexClass C>
+size_t runNeon(const char* s, size_t n) {
+    size_t i = 0;
+    // x in [lo, lo + span] as one unsigned compare: x - lo <= span
+    auto range = [](uint8x16_t x, uint8_t lo, uint8_t span) {
+        return vcleq_u8(vsubq_u8(x, vdupq_n_u8(lo)), vdupq_n_u8(span));
+    };
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(s + i)), m;
+        if (C == Spaces)
+            m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), range(v, '\t', '\r' - '\t'));
+        else if (C == Digits)
+            m = range(v, '0', 9);
+        else
+            m = vorrq_u8(vorrq_u8(range(vorrq_u8(v, vdupq_n_u8(0x20)), 'a', 25), range(v, '0', 9)),
+                         vceqq_u8(v, vdupq_n_u8('_')));
+        // narrow to 4 bits per byte to get a scalar mask
+        uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (~bits) return i + static_cast<size_t>(__builtin_ctzll(~bits)) / 4;
+    }
+    return i + runScalar<C>(s + i, n - i);
+}
+#endif
+
+const LexKernels& lexKernels() {
+    static const LexKernels k = [] {
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("avx512bw"))
+            return LexKernels{"avx512bw", runAvx512<Spaces>, runAvx512<Digits>, runAvx512<Ident>};
+        if (__builtin_cpu_supports("avx2"))
+            return LexKernels{"avx2", runAvx2<Spaces>, runAvx2<Digits>, runAvx2<Ident>};
+        if (__builtin_cpu_supports("sse2"))
+            return LexKernels{"sse2", runSse2<Spaces>, runSse2<Digits>, runSse2<Ident>};
+#elif defined(__aarch64__)
+        return LexKernels{"neon", runNeon<Spaces>, runNeon<Digits>, runNeon<Ident>};
+#endif
+        return LexKernels{"scalar", runScalar<Spaces>, runScalar<Digits>, runScalar<Ident>};
+    }();
+    return k;
+}
+
+// ---- native code ----
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+namespace {
+enum : int { RBX = 3, RBP = 5, R13 = 13, R14 = 14 };
+constexpr int kRegs = 12; // stack depth held in registers
+} // namespace
+
+// Minimal SSE2 assembler. Memory operands are [base + disp32] with base
+// one of rbx (vars), rbp (consts), r13 (spill) or r14 (result), none of
+// which needs a SIB byte.
+struct NativeCode::Asm {
+    vector<uint8_t> b;
+    vector<size_t> exits; // rel32 fields of jumps to the epilogue
+
+    void byte(uint8_t x) { b.push_back(x); }
+    void u32(uint32_t x) { for (int i = 0; i < 4; ++i) byte(static_cast<uint8_t>(x >> (8 * i))); }
+    void rex(bool w, int reg, int rm) {
+        if (w || reg >= 8 || rm >= 8) byte(static_cast<uint8_t>(0x40 | w << 3 | (reg >> 3) << 2 | rm >> 3));
+    }
+    void rr(uint8_t prefix, uint8_t op, int reg, int rm) { // op xmm(reg), xmm(rm)
+        byte(prefix);
+        rex(false, reg, rm);
+        byte(0x0F); byte(op);
+        byte(static_cast<uint8_t>(0xC0 | (reg & 7) << 3 | (rm & 7)));
+    }
+    void rm(uint8_t prefix, uint8_t op, int reg, int base, size_t disp) { // op xmm(reg), [base + disp]
+        byte(prefix);
+        rex(false, reg, base);
+        byte(0x0F); byte(op);
+        byte(static_cast<uint8_t>(0x80 | (reg & 7) << 3 | (base & 7)));
+        u32(static_cast<uint32_t>(disp));
+    }
+    void load(int x, int base, size_t disp) { rm(0xF2, 0x10, x, base, disp); }
+    void store(int x, int base, size_t disp) { rm(0xF2, 0x11, x, base, disp); }
+    void mov(int dst, int src) { if (dst != src) rr(0xF2, 0x10, dst, src); }
+    size_t jcc8(uint8_t op) { byte(op); byte(0); return b.size() - 1; }
+    void patch8(size_t at) { b[at] = static_cast<uint8_t>(b.size() - at - 1); }
+    void fail(uint32_t code) { // mov eax, code; jmp exit
+        byte(0xB8); u32(code);
+        byte(0xE9); exits.push_back(b.size()); u32(0);
+    }
+    void call(const void* f) { // mov rax, f; call rax
+        byte(0x48); byte(0xB8);
+        uint64_t p = reinterpret_cast<uintptr_t>(f);
+        for (int i = 0; i < 8; ++i) byte(static_cast<uint8_t>(p >> (8 * i)));
+        byte(0xFF); byte(0xD0);
+    }
+};
+
+bool NativeCode::generate(const Program& p, vector<double>& pool, Asm& a) {
+    auto reg = [](size_t d) { return static_cast<int>(4 + d); };
+    auto inReg = [](size_t d) { return d < kRegs; };
+    auto home = [](size_t d) { return d * sizeof(double); }; // spill slot of depth d
+    // value at depth d into a register: its own, or the scratch one
+    auto get = [&](size_t d, int scratch) {
+        if (inReg(d)) return reg(d);
+        a.load(scratch, R13, home(d));
+        return scratch;
+    };
+    auto put = [&](size_t d, int x) {
+        if (inReg(d)) a.mov(reg(d), x);
+        else a.store(x, R13, home(d));
+    };
+    // xmm0..xmm15 are caller-saved: park the live registers below depth d
+    auto spill = [&](size_t d) { for (size_t i = 0; i < min<size_t>(d, kRegs); ++i) a.store(reg(i), R13, home(i)); };
+    auto reload = [&](size_t d) { for (size_t i = 0; i < min<size_t>(d, kRegs); ++i) a.load(reg(i), R13, home(i)); };
+
+    // push rbx, rbp, r13, r14; sub rsp, 8; move the arguments to callee-saved registers
+    const uint8_t prologue[] = {0x53, 0x55, 0x41, 0x55, 0x41, 0x56, 0x48, 0x83, 0xEC, 0x08,
+                                0x48, 0x89, 0xFB, 0x48, 0x89, 0xF5, 0x49, 0x89, 0xD5, 0x49, 0x89, 0xCE};
+    a.b.assign(prologue, prologue + sizeof(prologue));
+
+    size_t d = 0;
+    for (size_t i = 0; i < p.code.size(); ++i) {
+        const Instr& in = p.code[i];
+        uint32_t err = static_cast<uint32_t>(i + 1);
+        switch (in.op) {
+        case Op::Const:
+            pool.push_back(in.value);
+            if (inReg(d)) a.load(reg(d), RBP, (pool.size() - 1) * sizeof(double));
+            else { a.load(2, RBP, (pool.size() - 1) * sizeof(double)); a.store(2, R13, home(d)); }
+            ++d;
+            continue;
+        case Op::Load:
+            if (inReg(d)) a.load(reg(d), RBX, in.slot * sizeof(double));
+            else { a.load(2, RBX, in.slot * sizeof(double)); a.store(2, R13, home(d)); }
+            ++d;
+            continue;
+        default: break;
+        }
+        if (isUnary(in.op)) {
+            int x = get(d - 1, 2);
+            switch (in.op) {
+            case Op::Neg:    a.load(3, RBP, 0); a.rr(0x66, 0x57, x, 3); break; // xorpd with -0.0
+            case Op::Square: a.rr(0xF2, 0x59, x, x); break;
+            case Op::Cube:   a.mov(3, x); a.rr(0xF2, 0x59, 3, x); a.rr(0xF2, 0x59, x, 3); break;
+            case Op::Sqrt: { // powHalf: sqrt(x) + 0, or +inf for -inf
+                a.rr(0x66, 0x57, 1, 1);
+                a.rr(0xF2, 0x51, 0, x);
+                a.rr(0xF2, 0x58, 0, 1);
+                a.load(3, RBP, sizeof(double));
+                a.rr(0x66, 0x2E, x, 3);
+                size_t j1 = a.jcc8(0x7A), j2 = a.jcc8(0x75);
+                a.load(0, RBP, 2 * sizeof(double));
+                a.patch8(j1); a.patch8(j2);
+                a.mov(x, 0);
+                break;
+            }
+            case Op::PowInt:
+                a.mov(0, x);
+                spill(d - 1);
+                a.byte(0xBF); a.u32(static_cast<uint32_t>(static_cast<int>(in.value))); // mov edi, e
+                a.call(reinterpret_cast<const void*>(&powInt));
+                reload(d - 1);
+                a.mov(x, 0);
+                break;
+            default: return false;
+            }
+            put(d - 1, x);
+            continue;
+        }
+        int x = get(d - 2, 2), y = get(d - 1, 3);
+        switch (in.op) {
+        case Op::Add: a.rr(0xF2, 0x58, x, y); break;
+        case Op::Sub: a.rr(0xF2, 0x5C, x, y); break;
+        case Op::Mul: a.rr(0xF2, 0x59, x, y); break;
+        case Op::Div: {
+            a.rr(0x66, 0x57, 1, 1);
+            a.rr(0x66, 0x2E, y, 1); // ucomisd y, 0: ZF and not PF means y == 0
+            size_t j1 = a.jcc8(0x7A), j2 = a.jcc8(0x75);
+            a.fail(err);
+            a.patch8(j1); a.patch8(j2);
+            a.rr(0xF2, 0x5E, x, y);
+            break;
+        }
+        case Op::Mod:
+        case Op::Pow: {
+            if (in.op == Op::Mod) { // cvttsd2si rax, y; test rax, rax: modByZero
+                a.byte(0xF2); a.rex(true, 0, y); a.byte(0x0F); a.byte(0x2C);
+                a.byte(static_cast<uint8_t>(0xC0 | (y & 7)));
+                a.byte(0x48); a.byte(0x85); a.byte(0xC0);
+                size_t j = a.jcc8(0x75);
+                a.fail(err);
+                a.patch8(j);
+            }
+            a.mov(0, x);
+            a.mov(1, y);
+            spill(d - 2);
+            double (*powFn)(double, double) = pow;
+            a.call(in.op == Op::Mod ? reinterpret_cast<const void*>(&modValues) : reinterpret_cast<const void*>(powFn));
+            reload(d - 2);
+            a.mov(x, 0);
+            break;
+        }
+        default: return false;
+        }
+        put(d - 2, x);
+        --d;
+    }
+    if (d) {
+        a.store(get(d - 1, 2), R14, 0);
+    } else {
+        a.rr(0x66, 0x57, 0, 0);
+        a.store(0, R14, 0);
+    }
+    a.byte(0x31); a.byte(0xC0); // xor eax, eax
+    for (size_t at : a.exits) {
+        uint32_t rel = static_cast<uint32_t>(a.b.size() - at - 4);
+        memcpy(&a.b[at], &rel, 4);
+    }
+    // add rsp, 8; pop r14, r13, rbp, rbx; ret
+    const uint8_t epilogue[] = {0x48, 0x83, 0xC4, 0x08, 0x41, 0x5E, 0x41, 0x5D, 0x5D, 0x5B, 0xC3};
+    a.b.insert(a.b.end(), epilogue, epilogue + sizeof(epilogue));
+    return true;
+}
+#endif
+
+NativeCode::~NativeCode() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (mem) munmap(mem, len);
+#endif
+}
+
+unique_ptr<NativeCode> NativeCode::compile(const Program& p) {
+#if defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+    unique_ptr<NativeCode> nc(new NativeCode);
+    nc->prog = &p;
+    nc->consts = {-0.0, -INFINITY, INFINITY};
+    Asm a;
+    if (!generate(p, nc->consts, a)) return nullptr;
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    nc->len = (a.b.size() + page - 1) / page * page;
+    void* m = mmap(nullptr, nc->len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED) return nullptr;
+    nc->mem = m;
+    memcpy(m, a.b.data(), a.b.size());
+    if (mprotect(m, nc->len, PROT_READ | PROT_EXEC) != 0) return nullptr;
+    nc->fn = reinterpret_cast<Fn>(m);
+    return nc;
+#else
+    (void)p;
+    return nullptr;
+#endif
+}
+
+// ---- program images ----
+namespace {
+size_t align8(size_t n) { return (n + 7) & ~size_t(7); }
+} // namespace
+
+bool ImageWriter::save(const char* path) const {
+    // layout first, then one buffer written with a single fwrite
+    vector<ImageEntry> index(progs.size());
+    size_t off = align8(sizeof(ImageHeader) + progs.size() * sizeof(ImageEntry));
+    for (size_t i = 0; i < progs.size(); ++i) {
+        const Program& p = progs[i];
+        ImageEntry& e = index[i];
+        e.codeCount = static_cast<uint32_t>(p.code.size());
+        e.bigIntCount = static_cast<uint32_t>(p.bigInts.size());
+        e.nameCount = static_cast<uint32_t>(p.names.size());
+        e.maxDepth = static_cast<uint32_t>(p.maxDepth);
+        e.code = off;
+        off += p.code.size() * sizeof(Instr);
+        e.bigInts = off;
+        off += p.bigInts.size() * sizeof(int64_t);
+        e.names = off;
+        off += p.names.size() * sizeof(ImageString);
+    }
+    size_t strings = off;
+    for (size_t i = 0; i < progs.size(); ++i) {
+        off += sources[i].size();
+        for (const string& n : progs[i].names) off += n.size();
+    }
+
+    vector<char> buf(off, 0); // zeroed, so Instr padding is written as zeros
+    ImageHeader h = {};
+    memcpy(h.magic, "CALCIMG", 8);
+    h.version = kImageVersion;
+    h.instrSize = sizeof(Instr);
+    h.count = progs.size();
+    h.entries = sizeof(ImageHeader);
+    h.size = buf.size();
+    memcpy(buf.data(), &h, sizeof(h));
+    auto putString = [&](string_view s) {
+        ImageString r = {strings, s.size()};
+        memcpy(buf.data() + strings, s.data(), s.size());
+        strings += s.size();
+        return r;
+    };
+    for (size_t i = 0; i < progs.size(); ++i) {
+        const Program& p = progs[i];
+        ImageEntry& e = index[i];
+        e.source = putString(sources[i]);
+        for (size_t j = 0; j < p.code.size(); ++j) {
+            char* rec = buf.data() + e.code + j * sizeof(Instr);
+            const Instr& in = p.code[j];
+            memcpy(rec + offsetof(Instr, op), &in.op, sizeof(in.op));
+            memcpy(rec + offsetof(Instr, value), &in.value, sizeof(in.value));
+            memcpy(rec + offsetof(Instr, slot), &in.slot, sizeof(in.slot));
+            memcpy(rec + offsetof(Instr, pos), &in.pos, sizeof(in.pos));
+        }
+        if (!p.bigInts.empty()) memcpy(buf.data() + e.bigInts, p.bigInts.data(), p.bigInts.size() * sizeof(int64_t));
+        for (size_t j = 0; j < p.names.size(); ++j) {
+            ImageString n = putString(p.names[j]);
+            memcpy(buf.data() + e.names + j * sizeof(ImageString), &n, sizeof(n));
+        }
+    }
+    if (!index.empty()) memcpy(buf.data() + sizeof(ImageHeader), index.data(), index.size() * sizeof(ImageEntry));
+
+    // write beside the target and rename over it, so processes that have the
+    // old image mapped keep running on the old file
+    string tmp = string(path) + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = fwrite(buf.data(), 1, buf.size(), f) == buf.size();
+    ok = fclose(f) == 0 && ok;
+    if (ok) ok = rename(tmp.c_str(), path) == 0;
+    if (!ok) {
+        int saved = errno;
+        remove(tmp.c_str());
+        errno = saved;
+    }
+    return ok;
+}
+
+ProgramImage::ProgramImage(const char* path) {
+#if defined(__unix__) || defined(__APPLE__)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) { err = "cannot open"; return; }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            base = static_cast<const char*>(p);
+            len = static_cast<size_t>(st.st_size);
+        }
+    }
+    close(fd);
+    if (!base) { err = "cannot map"; return; }
+    if (!check()) { entries = nullptr; count = 0; }
+#else
+    (void)path;
+    err = "program images need mmap";
+#endif
+}
+
+ProgramImage::~ProgramImage() {
+#if defined(__unix__) || defined(__APPLE__)
+    if (base) munmap(const_cast<char*>(base), len);
+#endif
+}
+
+bool ProgramImage::check() {
+    auto fits = [&](uint64_t off, uint64_t n, size_t elem) { return off <= len && n <= (len - off) / elem; };
+    auto array = [&](uint64_t off, uint64_t n, size_t elem) { return off % 8 == 0 && fits(off, n, elem); };
+    auto text = [&](const ImageString& s) { return fits(s.offset, s.len, 1); };
+
+    const ImageHeader* h = reinterpret_cast<const ImageHeader*>(base);
+    if (len < sizeof(ImageHeader) || memcmp(h->magic, "CALCIMG", 8) != 0) { err = "not a program image"; return false; }
+    if (h->version != kImageVersion) { err = "unsupported image version"; return false; }
+    if (h->instrSize != sizeof(Instr) || h->size != len || !array(h->entries, h->count, sizeof(ImageEntry))) {
+        err = "corrupt image header";
+        return false;
+    }
+    entries = reinterpret_cast<const ImageEntry*>(base + h->entries);
+    count = h->count;
+    for (size_t i = 0; i < count; ++i) {
+        const ImageEntry& e = entries[i];
+        if (!array(e.code, e.codeCount, sizeof(Instr)) || !array(e.bigInts, e.bigIntCount, sizeof(int64_t)) ||
+            !array(e.names, e.nameCount, sizeof(ImageString)) || !text(e.source) || e.maxDepth > e.codeCount) {
+            err = "corrupt program index";
+            return false;
+        }
+        for (size_t j = 0; j < e.nameCount; ++j)
+            if (!text(names(i)[j])) { err = "corrupt variable table"; return false; }
+        // the evaluators trust maxDepth, slots and the stack discipline
+        const Instr* code = reinterpret_cast<const Instr*>(base + e.code);
+        size_t d = 0;
+        for (size_t j = 0; j < e.codeCount; ++j) {
+            const Instr& in = code[j];
+            bool valid = in.op <= Op::Sqrt;
+            if (in.op == Op::Const) valid = in.slot <= e.bigIntCount;
+            else if (in.op == Op::Load) valid = in.slot < e.nameCount;
+            else if (in.op == Op::PowInt) valid = in.value == floor(in.value) && fabs(in.value) <= 64;
+            if (in.op == Op::Const || in.op == Op::Load) valid = valid && ++d <= e.maxDepth;
+            else if (isUnary(in.op)) valid = valid && d >= 1;
+            else valid = valid && d-- >= 2;
+            if (!valid) { err = "corrupt program code"; return false; }
+        }
+        if (d != (e.codeCount ? 1u : 0u)) { err = "corrupt program code"; return false; }
+    }
+    return true;
+}
+
+
+// ---- sessions ----
+uint32_t Session::node(string_view name) {
+    auto it = ids.find(string(name));
+    if (it != ids.end()) return it->second;
+    uint32_t id = static_cast<uint32_t>(nodes.size());
+    nodes.emplace_back();
+    Node& n = nodes.back();
+    n.name = string(name);
+    n.result = failure(ErrorCode::UnboundVariable, 0, n.name); // an input until defined or set
+    ids.emplace(n.name, id);
+    return id;
+}
+
+// Marks id and everything downstream of it; stops at nodes already dirty,
+// whose downstream is dirty too.
+void Session::markDirty(uint32_t id) {
+    vector<uint32_t> stack{id};
+    while (!stack.empty()) {
+        uint32_t i = stack.back();
+        stack.pop_back();
+        if (nodes[i].dirty) continue;
+        nodes[i].dirty = true;
+        pending.push_back(i);
+        for (uint32_t u : nodes[i].users) stack.push_back(u);
+    }
+}
+
+// Whether any of deps is id or downstream of it.
+bool Session::reaches(uint32_t id, const vector<uint32_t>& deps) const {
+    if (nodes[id].users.empty()) return find(deps.begin(), deps.end(), id) != deps.end();
+    vector<bool> down(nodes.size());
+    vector<uint32_t> stack{id};
+    while (!stack.empty()) {
+        uint32_t i = stack.back();
+        stack.pop_back();
+        if (down[i]) continue;
+        down[i] = true;
+        for (uint32_t u : nodes[i].users) stack.push_back(u);
+    }
+    for (uint32_t d : deps)
+        if (down[d]) return true;
+    return false;
+}
+
+EvalResult Session::define(string_view name, string_view formula) {
+    Parser p(formula);
+    EvalResult r = p.tryCompile();
+    if (!r.ok()) return r;
+    Program prog = p.program();
+    prog.optimize();
+
+    // Check for a cycle before creating any node, so a rejected formula
+    // leaves no new inputs behind. Names not seen yet cannot be downstream.
+    const vector<string>& vars = prog.variables();
+    auto known = ids.find(string(name));
+    if (known == ids.end()) {
+        if (find(vars.begin(), vars.end(), name) != vars.end()) return failure(ErrorCode::CyclicDefinition, 0, name);
+    } else {
+        vector<uint32_t> seen;
+        for (const string& v : vars) {
+            auto d = ids.find(v);
+            if (d != ids.end()) seen.push_back(d->second);
+        }
+        if (reaches(known->second, seen)) return failure(ErrorCode::CyclicDefinition, 0, nodes[known->second].name);
+    }
+
+    uint32_t id = node(name);
+    vector<uint32_t> deps;
+    for (const string& v : vars) deps.push_back(node(v));
+    Node& n = nodes[id];
+    for (uint32_t d : n.deps) { // unhook the old formula
+        auto& u = nodes[d].users;
+        u.erase(find(u.begin(), u.end(), id));
+    }
+    for (uint32_t d : deps) nodes[d].users.push_back(id);
+    n.deps = std::move(deps);
+    n.prog = std::move(prog);
+    n.input = false;
+    markDirty(id);
+    return EvalResult{};
+}
+
+EvalResult Session::assign(string_view line) {
+    size_t eq = line.find('=');
+    size_t b = 0, e = eq == string_view::npos ? line.size() : eq;
+    while (b < e && Lexer::isSpace(line[b])) ++b;
+    while (e > b && Lexer::isSpace(line[e - 1])) --e;
+    bool ident = b < e && Lexer::isIdentStart(line[b]);
+    for (size_t i = b; ident && i < e; ++i) ident = Lexer::isIdentChar(line[i]);
+    if (eq == string_view::npos || !ident) return failure(ErrorCode::BadAssignment, ident ? line.size() : b);
+    EvalResult r = define(line.substr(b, e - b), line.substr(eq + 1));
+    if (r.error != ErrorCode::CyclicDefinition && !r.ok()) r.pos += eq + 1; // into line, not the formula
+    return r;
+}
+
+void Session::set(string_view name, double value) {
+    uint32_t id = node(name);
+    Node& n = nodes[id];
+    for (uint32_t d : n.deps) {
+        auto& u = nodes[d].users;
+        u.erase(find(u.begin(), u.end(), id));
+    }
+    n.deps.clear();
+    n.prog = Program();
+    n.input = true;
+    n.hasValue = true;
+    n.result = EvalResult{};
+    n.result.value = value;
+    markDirty(id);
+}
+
+void Session::evaluate(Node& n) const {
+    if (n.input) {
+        if (!n.hasValue) n.result = failure(ErrorCode::UnboundVariable, 0, n.name);
+        return;
+    }
+    thread_local vector<double> vars;
+    vars.resize(n.deps.size());
+    for (size_t i = 0; i < n.deps.size(); ++i) {
+        const EvalResult& d = nodes[n.deps[i]].result;
+        if (!d.ok()) { n.result = d; return; }
+        vars[i] = d.value;
+    }
+    n.result = n.prog.tryRun(vars.data());
+}
+
+// Kahn's algorithm over the dirty nodes only, a wave at a time.
+Session::RecomputeReport Session::recompute() {
+    RecomputeReport rep;
+    // a call that threw left the nodes it finished clean but still pending
+    pending.erase(remove_if(pending.begin(), pending.end(), [&](uint32_t i) { return !nodes[i].dirty; }),
+                  pending.end());
+    for (uint32_t i : pending) {
+        uint32_t w = 0;
+        for (uint32_t d : nodes[i].deps) w += nodes[d].dirty;
+        nodes[i].waiting = w;
+    }
+    vector<uint32_t> wave, next;
+    for (uint32_t i : pending)
+        if (!nodes[i].waiting) wave.push_back(i);
+    const size_t perThread = 256; // below this a wave is cheaper on one thread
+    while (!wave.empty()) {
+        unsigned t = static_cast<unsigned>(min<size_t>(threads, wave.size() / perThread));
+        if (t > 1) {
+            // Slices 1..t-1 go to the pool, the caller runs slice 0; the count
+            // drops under the lock so the last slice is done with the shared
+            // state once the caller can see zero. A slice that throws stops
+            // and leaves the exception for the caller, which rethrows it only
+            // once no slice is running.
+            struct Slice {
+                Session* self;
+                const uint32_t *begin, *end;
+                unsigned* left;
+                exception_ptr* error;
+                mutex* m;
+                condition_variable* done;
+                void evaluate() const {
+                    for (const uint32_t* i = begin; i != end; ++i) self->evaluate(self->nodes[*i]);
+                }
+                static void run(void* arg) {
+                    const Slice& s = *static_cast<Slice*>(arg);
+                    exception_ptr e;
+                    try {
+                        s.evaluate();
+                    } catch (...) {
+                        e = current_exception();
+                    }
+                    lock_guard<mutex> lk(*s.m);
+                    if (e && !*s.error) *s.error = e;
+                    if (--*s.left == 0) s.done->notify_one();
+                }
+            };
+            if (!pool) pool = make_unique<EvalPool>(threads - 1);
+            mutex m;
+            condition_variable done;
+            unsigned left = t - 1;
+            exception_ptr error;
+            size_t step = (wave.size() + t - 1) / t;
+            Slice slices[64];
+            vector<Slice> many;
+            Slice* s = slices;
+            if (t > 64) { many.resize(t); s = many.data(); }
+            const uint32_t* w = wave.data();
+            for (unsigned k = 0; k < t; ++k)
+                s[k] = {this, w + min(wave.size(), k * step), w + min(wave.size(), (k + 1) * step), &left, &error, &m,
+                        &done};
+            for (unsigned k = 1; k < t; ++k) pool->post(Slice::run, &s[k]);
+            exception_ptr mine;
+            try {
+                s[0].evaluate();
+            } catch (...) {
+                mine = current_exception();
+            }
+            unique_lock<mutex> lk(m);
+            done.wait(lk, [&] { return left == 0; });
+            if (mine || error) rethrow_exception(mine ? mine : error);
+        } else {
+            for (uint32_t i : wave) evaluate(nodes[i]);
+        }
+        next.clear();
+        for (uint32_t i : wave) {
+            nodes[i].dirty = false;
+            for (uint32_t u : nodes[i].users)
+                if (--nodes[u].waiting == 0) next.push_back(u);
+        }
+        rep.recomputed += wave.size();
+        ++rep.waves;
+        swap(wave, next);
+    }
+    pending.clear();
+    total += rep.recomputed;
+    return rep;
+}
+
+EvalResult Session::value(string_view name) const {
+    auto it = ids.find(string(name));
+    if (it == ids.end()) return failure(ErrorCode::UnboundVariable, 0, name);
+    return nodes[it->second].result;
+}
+
+// ---- eval pool ----
+EvalPool::EvalPool(unsigned threads) {
+    if (!threads) threads = max(1u, thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; ++i) workers.emplace_back([this] { work(); });
+}
+
+EvalPool::~EvalPool() {
+    {
+        lock_guard<mutex> lk(m);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread& t : workers) t.join();
+}
+
+void EvalPool::post(void (*fn)(void*), void* arg) {
+    {
+        lock_guard<mutex> lk(m);
+        jobs.push_back({fn, arg});
+    }
+    ready.notify_one();
+}
+
+void EvalPool::work() {
+    while (true) {
+        Job job;
+        {
+            unique_lock<mutex> lk(m);
+            ready.wait(lk, [&] { return stopping || !jobs.empty(); });
+            if (jobs.empty()) return; // stopping, and nothing left to run
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        job.fn(job.arg);
+    }
+}
+
+} // namespace calc
+
+// ---- C ABI ----
+using namespace calc;
+
+struct calc_parser {
+    Parser parser{""};
+};
+
+struct calc_program {
+    Program program;
+};
+
+static calc_result toC(const EvalResult& r) {
+    calc_result c;
+    c.value = r.value;
+    c.error = static_cast<int32_t>(r.error);
+    c.pos = r.pos;
+    c.detail = r.detail.data();
+    c.detail_len = r.detail.size();
+    return c;
+}
+
+static calc_result outOfMemory() {
+    calc_result c = toC(EvalResult{});
+    c.error = CALC_OUT_OF_MEMORY;
+    return c;
+}
+
+extern "C" {
+
+uint32_t calc_abi_version(void) { return CALC_ABI_VERSION; }
+
+calc_parser* calc_parser_new(void) { return new (nothrow) calc_parser; }
+void calc_parser_free(calc_parser* p) { delete p; }
+
+void calc_parser_set_limits(calc_parser* p, const calc_limits* limits) {
+    Limits l;
+    if (limits) l = Limits{limits->input_bytes, limits->tokens, limits->depth, limits->steps};
+    p->parser.setLimits(l);
+}
+
+calc_result calc_eval(calc_parser* p, const char* src, size_t len) {
+    try {
+        p->parser.reset(string_view(src, len));
+        return toC(p->parser.tryParse());
+    } catch (const bad_alloc&) {
+        return outOfMemory();
+    }
+}
+
+calc_program* calc_compile(calc_parser* p, const char* src, size_t len, calc_result* status) {
+    try {
+        p->parser.reset(string_view(src, len));
+        EvalResult r = p->parser.tryCompile();
+        if (status) *status = toC(r);
+        if (!r.ok()) return nullptr;
+        // a copy of what tryCompile() left, so p keeps its buffers' capacity
+        return new calc_program{p->parser.program()};
+    } catch (const bad_alloc&) {
+        if (status) *status = outOfMemory();
+        return nullptr;
+    }
+}
+
+void calc_program_free(calc_program* prog) { delete prog; }
+
+size_t calc_program_size(const calc_program* prog) { return prog->program.size(); }
+
+size_t calc_program_variable_count(const calc_program* prog) { return prog->program.variables().size(); }
+
+const char* calc_program_variable_name(const calc_program* prog, size_t slot) {
+    const vector<string>& names = prog->program.variables();
+    return slot < names.size() ? names[slot].c_str() : nullptr;
+}
+
+calc_result calc_program_run(const calc_program* prog, const double* vars) {
+    try {
+        return toC(prog->program.tryRun(vars));
+    } catch (const bad_alloc&) {
+        return outOfMemory(); // the value stack of a program deeper than 64
+    }
+}
+
+calc_result calc_program_run_batch(const calc_program* prog, const double* const* columns, size_t rows, double* out) {
+    try {
+        return toC(prog->program.tryRunBatch(columns, rows, out));
+    } catch (const bad_alloc&) {
+        return outOfMemory();
+    }
+}
+
+int calc_error_message(const calc_result* r, char* buf, size_t n) {
+    if (r->error == CALC_OUT_OF_MEMORY) return snprintf(buf, n, "Out of memory");
+    EvalResult e;
+    e.error = static_cast<ErrorCode>(r->error);
+    e.pos = r->pos;
+    e.detail = string_view(r->detail ? r->detail : "", r->detail_len);
+    return e.format(buf, n);
+}
+
+} // extern "C"
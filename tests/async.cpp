@@ -0,0 +1,153 @@
+// async.cpp - evalAsync / evalBatchAsync under C++20: small input completes
+// inline without suspending, large input and batches resume from the pool,
+// and results match a plain Parser. bad_alloc on a pool thread comes back
+// out of the co_await.
+#include "calc.hpp"
+#include "check.hpp"
+#include "fail_alloc.hpp"
+
+#include <future>
+#include <string>
+
+static_assert(CALC_HAS_COROUTINES, "tests/async.cpp must be built as C++20");
+
+using namespace calc;
+using std::string;
+using std::string_view;
+using std::vector;
+
+// Just enough of a task type to run a coroutine to completion and wait.
+struct Task {
+    struct promise_type {
+        std::promise<void> done;
+        Task get_return_object() { return Task{done.get_future()}; }
+        std::suspend_never initial_suspend() { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { done.set_value(); }
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::future<void> finished;
+    void wait() { finished.get(); }
+};
+
+static Task evalOne(EvalPool& pool, string_view src, const AsyncOptions& opt, EvalResult& out, std::thread::id& on) {
+    out = co_await evalAsync(pool, src, opt);
+    on = std::this_thread::get_id();
+}
+
+static Task evalMany(EvalPool& pool, const vector<string_view>& srcs, const AsyncOptions& opt,
+                     vector<EvalResult>& out, std::thread::id& on) {
+    co_await evalBatchAsync(pool, srcs.data(), srcs.size(), out.data(), opt);
+    on = std::this_thread::get_id();
+}
+
+// As above, noting whether the co_await threw bad_alloc.
+static Task evalOneOrThrow(EvalPool& pool, string_view src, const AsyncOptions& opt, bool& threw) {
+    try {
+        co_await evalAsync(pool, src, opt);
+        threw = false;
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+}
+
+static Task evalManyOrThrow(EvalPool& pool, const vector<string_view>& srcs, const AsyncOptions& opt,
+                            vector<EvalResult>& out, bool& threw) {
+    try {
+        co_await evalBatchAsync(pool, srcs.data(), srcs.size(), out.data(), opt);
+        threw = false;
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+}
+
+static bool same(const EvalResult& a, const EvalResult& b) {
+    return a.error == b.error && a.pos == b.pos && (a.ok() ? a.value == b.value : a.detail == b.detail);
+}
+
+int main() {
+    EvalPool pool(4);
+    CHECK(pool.size() == 4);
+    const std::thread::id self = std::this_thread::get_id();
+    AsyncOptions opt;
+    EvalResult r;
+    std::thread::id on;
+
+    // Inline: below offloadBytes the coroutine never leaves this thread.
+    evalOne(pool, "1+2*3", opt, r, on).wait();
+    CHECK(r.ok() && r.value == 7 && on == self);
+
+    // Offloaded: the coroutine resumes on a pool thread.
+    string big;
+    for (int i = 0; i < 20000; ++i) big += "1+";
+    big += "1";
+    evalOne(pool, big, opt, r, on).wait();
+    CHECK(r.ok() && r.value == 20001 && on != self);
+
+    // The detail is the failing token of the caller's source, not the first
+    // match of its text ("e" also occurs in the exponent of 1e3).
+    string unbound = "1e3+e";
+    evalOne(pool, unbound, opt, r, on).wait();
+    CHECK(r.error == ErrorCode::UnboundVariable && r.detail.data() == unbound.data() + 4);
+    unbound += big.substr(1); // "+1+1..." : long enough to offload
+    evalOne(pool, unbound, opt, r, on).wait();
+    CHECK(on != self && r.error == ErrorCode::UnboundVariable && r.detail.data() == unbound.data() + 4);
+
+    // Budgets apply on both paths.
+    opt.limits.depth = 2;
+    evalOne(pool, "((1))+(((2)))", opt, r, on).wait();
+    CHECK(r.error == ErrorCode::NestingTooDeep && r.pos == 8);
+    opt.limits = Limits{};
+
+    // Batches: inline while the total is small, else split across the pool and
+    // resumed once. Every result matches a plain parse of the same input.
+    vector<string> text;
+    for (int i = 0; i < 3000; ++i)
+        text.push_back(std::to_string(i) + "*2+" + std::to_string(i % 7) + (i % 97 == 0 ? "/0" : i % 89 == 0 ? "+v" : ""));
+    vector<string_view> srcs(text.begin(), text.end());
+    for (size_t threshold : {size_t(1) << 20, size_t(1)}) {
+        opt.offloadBytes = threshold;
+        for (int round = 0; round < 50; ++round) {
+            vector<EvalResult> out(srcs.size());
+            evalMany(pool, srcs, opt, out, on).wait();
+            CHECK((on == self) == (threshold > 1));
+            for (size_t i = 0; i < srcs.size(); ++i) CHECK(same(out[i], Parser(srcs[i]).tryParse()));
+        }
+    }
+
+    // Edge cases: an empty batch and a single expression, with offloading forced.
+    opt.offloadBytes = 0;
+    vector<string_view> none, one{"7"};
+    vector<EvalResult> noOut, oneOut(1);
+    evalMany(pool, none, opt, noOut, on).wait();
+    CHECK(on == self);
+    evalMany(pool, one, opt, oneOut, on).wait();
+    CHECK(oneOut[0].ok() && oneOut[0].value == 7);
+    for (int i = 0; i < 2000; ++i) {
+        evalOne(pool, "3+4", opt, r, on).wait();
+        CHECK(r.value == 7);
+    }
+
+    // Out of memory on the pool: the token buffer of a 2 MB expression cannot
+    // grow past 1 MB. The co_await rethrows; for a batch, once, after every
+    // part has finished, and the pool's parsers are fine afterwards.
+    opt = AsyncOptions{};
+    string huge;
+    for (int i = 0; i < 1000000; ++i) huge += "1+";
+    huge += "1";
+    vector<string_view> mixed(srcs.begin(), srcs.end());
+    mixed.insert(mixed.begin() + 1500, huge);
+    vector<EvalResult> mixedOut(mixed.size());
+    bool threw = false;
+    failAllocsFrom = 1 << 20;
+    evalOneOrThrow(pool, huge, opt, threw).wait();
+    CHECK(threw);
+    evalManyOrThrow(pool, mixed, opt, mixedOut, threw).wait();
+    CHECK(threw);
+    failAllocsFrom = SIZE_MAX;
+    evalManyOrThrow(pool, mixed, opt, mixedOut, threw).wait();
+    CHECK(!threw);
+    CHECK(mixedOut[1500].ok() && mixedOut[1500].value == 1000001);
+    for (size_t i = 0; i < mixed.size(); i += 101) CHECK(same(mixedOut[i], Parser(mixed[i]).tryParse()));
+    return checkFailures != 0;
+}
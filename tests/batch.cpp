@@ -0,0 +1,78 @@
+// batch.cpp - tryRunBatch is bit-identical to tryRun on every row, optimized
+// or not, whatever the row count (tails shorter than a vector) and for ±0,
+// inf and NaN. Only a NaN may differ (see sameBits).
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::string;
+using std::vector;
+
+static string gen(std::mt19937& rng, int d) {
+    if (d == 0 || rng() % 4 == 0) return leaf(rng);
+    string a = gen(rng, d - 1), b = gen(rng, d - 1);
+    static const char* exponents[] = {"2", "3", "0.5", "4", "5", "-1", "-2", "7", "1", "0"};
+    switch (rng() % 10) {
+    case 8:
+    case 9:  return "(" + a + ")^" + exponents[rng() % 10]; // Square/Cube/PowInt/Sqrt once optimized
+    case 0:  return "(" + a + "+" + b + ")";
+    case 1:  return "(" + a + "-" + b + ")";
+    case 2:  return "(" + a + "*" + b + ")";
+    case 3:  return "(" + a + "/" + b + ")";
+    case 4:  return "(" + a + "%" + b + ")";
+    case 5:  return "(" + a + ")^(" + b + ")";
+    default: return "-(" + a + ")";
+    }
+}
+
+// Checks prog over `rows` rows drawn from kValues: every row's bits, and that
+// the batch fails exactly when some row does. It runs an operator at a time
+// over all rows, so its error is the earliest failing instruction of any row:
+// one of the rows' own errors, not necessarily the first row's.
+static void compare(const Program& prog, size_t rows, std::mt19937& rng) {
+    size_t nv = prog.variables().size();
+    vector<vector<double>> cols(nv, vector<double>(rows));
+    vector<const double*> ptrs;
+    for (auto& c : cols) {
+        for (double& v : c) v = kValues[rng() % (sizeof kValues / sizeof *kValues)];
+        ptrs.push_back(c.data());
+    }
+    vector<double> out(rows), vars(nv);
+    EvalResult batch = prog.tryRunBatch(ptrs.data(), rows, out.data());
+    bool same = true, anyError = false, matched = false;
+    for (size_t row = 0; row < rows; ++row) {
+        for (size_t i = 0; i < nv; ++i) vars[i] = cols[i][row];
+        EvalResult r = prog.tryRun(vars.data());
+        if (!r.ok()) {
+            anyError = true;
+            matched |= r.error == batch.error && r.pos == batch.pos;
+            continue;
+        }
+        if (batch.ok() && !sameBits(out[row], r.value)) same = false;
+    }
+    CHECK(same);
+    CHECK(batch.ok() != anyError);
+    CHECK(batch.ok() || matched);
+}
+
+int main() {
+    std::mt19937 rng(2);
+    const size_t rowCounts[] = {1, 2, 3, 5, 7, 9, 15, 17, 31, 33, 511, 513, 1027};
+    for (int i = 0; i < 1500; ++i) {
+        string src = gen(rng, 4); // the parser views it
+        Parser p(src, {"x", "y", "z"});
+        CHECK(p.tryCompile().ok());
+        size_t rows = rowCounts[i % (sizeof rowCounts / sizeof *rowCounts)];
+        compare(p.program(), rows, rng);
+        // optimized, both rewrite sets: the unary exponent kernels, folded constants
+        for (bool strict : {true, false}) {
+            Program prog = p.program();
+            prog.optimize(strict);
+            compare(prog, rows, rng);
+        }
+    }
+    return checkFailures != 0;
+}
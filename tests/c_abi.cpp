@@ -0,0 +1,43 @@
+// c_abi.cpp - the C interface in calc.h: compile once, run many, and the
+// program handed out is exactly the one the parser compiled.
+#include "calc.h"
+#include "check.hpp"
+
+#include <cstring>
+
+static calc_program* compile(calc_parser* p, const char* src, calc_result* status) {
+    return calc_compile(p, src, std::strlen(src), status);
+}
+
+int main() {
+    CHECK(calc_abi_version() == CALC_ABI_VERSION);
+    calc_parser* p = calc_parser_new();
+    CHECK(p != nullptr);
+
+    calc_result st;
+    calc_program* prog = compile(p, "1+2*3", &st);
+    CHECK(prog && st.error == CALC_OK);
+    CHECK(calc_program_size(prog) == 5); // 1 2 3 * +
+    calc_result r = calc_program_run(prog, nullptr);
+    CHECK(r.error == CALC_OK && r.value == 7);
+    calc_program_free(prog);
+
+    // The same parser again, with variables: the count reflects this input only.
+    prog = compile(p, "x*y+x", &st);
+    CHECK(prog && calc_program_size(prog) == 5);
+    CHECK(calc_program_variable_count(prog) == 2);
+    CHECK(std::strcmp(calc_program_variable_name(prog, 0), "x") == 0);
+    double vars[] = {2, 5};
+    r = calc_program_run(prog, vars);
+    CHECK(r.error == CALC_OK && r.value == 12);
+    calc_program_free(prog);
+
+    CHECK(compile(p, "1+", &st) == nullptr && st.error == CALC_EXPECTED_NUMBER);
+    r = calc_eval(p, "8%0", 3);
+    CHECK(r.error == CALC_MODULO_BY_ZERO);
+    char msg[64];
+    CHECK(calc_error_message(&r, msg, sizeof msg) > 0);
+
+    calc_parser_free(p);
+    return checkFailures != 0;
+}
@@ -0,0 +1,40 @@
+// check.hpp - what the tests share. A failed CHECK reports the expression and
+// line and the test exits non-zero at the end of main(). sameBits, leaf and
+// kValues serve the tests that compare two engines on random formulas.
+#ifndef CALC_TESTS_CHECK_HPP
+#define CALC_TESTS_CHECK_HPP
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+
+inline int checkFailures = 0;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++checkFailures;                                                     \
+        }                                                                        \
+    } while (0)
+
+// The same bits, except that any NaN matches any NaN: when two NaNs meet,
+// which one propagates is up to operand order, which the compiler may commute,
+// so only a NaN's sign and payload may differ.
+inline bool sameBits(double a, double b) { return std::memcmp(&a, &b, sizeof a) == 0 || (a != a && b != b); }
+
+// A random formula leaf: a literal, zero (so '/' and '%' can fail) or x, y, z.
+inline std::string leaf(std::mt19937& rng) {
+    switch (rng() % 6) {
+    case 0:  return std::to_string(rng() % 7) + ".25";
+    case 1:  return "0";
+    default: return std::string(1, "xyz"[rng() % 3]);
+    }
+}
+
+// Variable values covering ±0, subnormals, huge values, ±inf and NaN.
+inline const double kValues[] = {0.0, -0.0, 1, -1, 2.5, -3.75, 0.5, 1e300, -1e-310, INFINITY, -INFINITY, NAN, 7, 1e17};
+
+#endif // CALC_TESTS_CHECK_HPP
@@ -0,0 +1,32 @@
+// compile.cpp - Parser::compile/tryCompile produce the same program however
+// often, and in whichever order, they are called.
+#include "calc.hpp"
+#include "check.hpp"
+
+using namespace calc;
+using std::string;
+using std::vector;
+
+int main() {
+    for (Parser::Engine e : {Parser::Engine::Precedence, Parser::Engine::Recursive}) {
+        Parser p("1+2*3");
+        p.setEngine(e);
+        CHECK(p.tryCompile().ok());
+        size_t once = p.program().size();
+        CHECK(once == 5);
+        CHECK(p.tryCompile().ok());
+        CHECK(p.program().size() == once);
+        Program prog = p.compile();
+        CHECK(prog.size() == once);
+        CHECK(prog.run() == 7);
+        CHECK(p.parse() == 7); // compile() moved the program out; parsing again rebuilds it
+
+        Parser q("x*y+x", {"y"});
+        q.setEngine(e);
+        CHECK(q.tryCompile().ok());
+        CHECK(q.tryCompile().ok());
+        CHECK(q.program().variables() == (vector<string>{"y", "x"}));
+        CHECK(q.program().size() == 5);
+    }
+    return checkFailures != 0;
+}
@@ -0,0 +1,95 @@
+// constexpr.cpp - calc::eval folded at compile time and CALC_FORMULA's
+// inlined arithmetic give what Parser gives at run time: the same bits for
+// pow, '%', implicit multiplication and arguments in order of first use, and
+// CalcError with the same code and position where Parser fails.
+#include "calc.hpp"
+#include "check.hpp"
+
+using namespace calc;
+
+static_assert(calc::eval("2^10 - 3(4) + 7 % 4") == 1015, "constexpr grammar out of step with Parser");
+
+// A constant folded by the compiler against the same text parsed at run time.
+#define FOLDS(src)                                   \
+    do {                                             \
+        constexpr double folded = calc::eval(src);   \
+        CHECK(sameBits(folded, Parser(src).parse())); \
+    } while (0)
+
+// f, the CALC_FORMULA of src, against Program::tryRun over every triple of kValues.
+template <class F>
+static void agree(F f, const char* src) {
+    Parser p(src);
+    CHECK(p.tryCompile().ok());
+    const Program& prog = p.program();
+    CHECK(prog.variables().size() == F::arity);
+    for (size_t i = 0; i < F::arity && i < prog.variables().size(); ++i) CHECK(prog.variables()[i] == F::variable(i));
+    for (double x : kValues)
+        for (double y : kValues)
+            for (double z : kValues) {
+                const double vars[] = {x, y, z};
+                EvalResult want = prog.tryRun(vars);
+                try {
+                    double got = f(vars);
+                    CHECK(want.ok() && sameBits(got, want.value));
+                } catch (const CalcError& e) {
+                    CHECK(e.code() == want.error && e.pos() == want.pos);
+                }
+            }
+}
+#define AGREE(src) agree(CALC_FORMULA(src), src)
+
+int main() {
+    FOLDS("2^10");
+    FOLDS("(-3)^3");
+    FOLDS("-2^2");
+    FOLDS("2^3^2");
+    FOLDS("7 % 4");
+    FOLDS("-7 % 3");
+    FOLDS("7.5 % -2");
+    FOLDS("1e22 % 7");
+    FOLDS("2(3)(4)");
+    FOLDS("(1+2)(3+4) - 5(6)");
+    FOLDS("0.1 + 0.2");
+    FOLDS("1/3");
+
+    AGREE("x^y");
+    AGREE("x^2 + y^3 - z^0.5");
+    AGREE("x % y");
+    AGREE("(x - y) % z");
+    AGREE("2x(y+1)z");
+    AGREE("(x)(y)(z)");
+    AGREE("y - x*z");
+    AGREE("z / (x - y)");
+    AGREE("-x^y % z");
+
+    auto diff = CALC_FORMULA("b - a"); // b is used first, so it is the first argument
+    CHECK(diff(10, 3) == 7);
+
+    auto ratio = CALC_FORMULA("x / (y - 1)");
+    bool threw = false;
+    try {
+        ratio(1.0, 1.0);
+    } catch (const CalcError& e) {
+        threw = e.code() == ErrorCode::DivisionByZero && e.pos() == 2;
+    }
+    CHECK(threw);
+    threw = false;
+    try {
+        CALC_FORMULA("x % 0")(1.0);
+    } catch (const CalcError& e) {
+        threw = e.code() == ErrorCode::ModuloByZero;
+    }
+    CHECK(threw);
+
+    // Not a constant expression, so eval() takes the run-time path and throws.
+    std::string text = "1 / (2 - 2)";
+    threw = false;
+    try {
+        calc::eval(std::string_view(text));
+    } catch (const CalcError& e) {
+        threw = e.code() == ErrorCode::DivisionByZero;
+    }
+    CHECK(threw);
+    return checkFailures != 0;
+}
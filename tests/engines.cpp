@@ -0,0 +1,59 @@
+// engines.cpp - the precedence engine (the default) against the recursive
+// one on random token strings, well-formed or not: same error and position,
+// same program size and the same value.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace calc;
+using std::string;
+
+static string tokens(std::mt19937& rng) {
+    static const char* pieces[] = {"1", "2.5", "3e2", "0", "7", "1e400", ".5", "x", "y", "foo", "+", "-", "*", "/",
+                                   "%", "^", "**", "(", ")", " ", "  ", "\t", "#", "1.2.3", "e", "2(", ")("};
+    string s;
+    for (size_t n = rng() % 14 + 1; n--;) s += pieces[rng() % (sizeof pieces / sizeof *pieces)];
+    return s;
+}
+
+// Mostly well-formed, so values get compared too.
+static string formula(std::mt19937& rng, int d) {
+    if (d == 0 || rng() % 4 == 0) return rng() % 3 ? std::to_string(rng() % 9 + 1) : string(1, "xy"[rng() % 2]);
+    static const char* ops[] = {"+", "-", "*", "/", "%", "^", "**", ""};
+    switch (rng() % 4) {
+    case 0:  return "(" + formula(rng, d - 1) + ")";
+    case 1:  return string(rng() % 2 ? "-" : "+") + formula(rng, d - 1);
+    default: return formula(rng, d - 1) + ops[rng() % 8] + formula(rng, d - 1);
+    }
+}
+
+static bool agree(const string& src) {
+    Parser a(src, {"x", "y"}), b(src, {"x", "y"});
+    a.setEngine(Parser::Engine::Precedence);
+    b.setEngine(Parser::Engine::Recursive);
+    EvalResult ra = a.tryCompile(), rb = b.tryCompile();
+    bool ok = ra.error == rb.error && ra.pos == rb.pos;
+    if (ok && ra.ok()) {
+        ok = a.program().size() == b.program().size() && a.program().variables() == b.program().variables();
+        std::vector<double> vars(a.program().variables().size()); // x, y, then any others at 0
+        vars[0] = 1.5;
+        vars[1] = -2.25;
+        EvalResult va = a.program().tryRun(vars.data()), vb = b.program().tryRun(vars.data());
+        ok = ok && va.error == vb.error && va.pos == vb.pos && sameBits(va.value, vb.value);
+    }
+    if (!ok) fprintf(stderr, "  '%s': %s vs %s\n", src.c_str(), ra.message().c_str(), rb.message().c_str());
+    return ok;
+}
+
+int main() {
+    const char* fixed[] = {"", " ", "()", "(", ")", "1+", "+", "2^^3", "2**-3", "-2^2", "2(3)(4)", "((1)",
+                           "1)", "1 2", "x y", "3.5(2)+1e-3", "1e400", "2^3^2", "-(-(-x))", "1/0", "5%0"};
+    for (const char* s : fixed) CHECK(agree(s));
+    std::mt19937 rng(10);
+    for (int i = 0; i < 100000; ++i) CHECK(agree(tokens(rng)));
+    for (int i = 0; i < 20000; ++i) CHECK(agree(formula(rng, 5)));
+    return checkFailures != 0;
+}
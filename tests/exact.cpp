@@ -0,0 +1,49 @@
+// exact.cpp - tryRunExact agrees with tryRun wherever the double path is
+// exact, and reports integral/exact by value, never for garbage.
+#include "calc.hpp"
+#include "check.hpp"
+
+using namespace calc;
+using std::isinf;
+
+static EvalResult exact(const char* s) { return Parser(s).tryParseExact(); }
+
+int main() {
+    // Small operands: every step is exact in double too, so the two agree bit
+    // for bit, down to the sign of zero and of infinity.
+    const char* agree[] = {"1+2*3", "-0", "-0^-3", "-(0)^-3", "(-0)^-1", "-0*5", "0*-1", "-(2-2)", "7/2",
+                           "2^-1", "-7%3", "7%-3", "-8%2", "5%-1", "2^10-1", "(1-1)/-4", "(2-2)*-3", "-3*0", "0/5", "0*0", "-(3%3)^-1",
+                           "2^64%10", "1e19%7", "-(2^70)%3", "5%1e19", "2^63%2^62", "1e300%7"};
+    for (const char* s : agree) {
+        EvalResult d = Parser(s).tryParse(), e = exact(s);
+        CHECK(d.ok() && e.ok());
+        if (!sameBits(d.value, e.value)) fprintf(stderr, "  %s: %g vs %g\n", s, d.value, e.value);
+        CHECK(sameBits(d.value, e.value));
+    }
+    EvalResult r = exact("-0^-3");
+    CHECK(r.value < 0 && isinf(r.value) && !r.integral);
+    CHECK(!exact("-0").integral);
+
+    // Out-of-range operands are reduced exactly, not through a wrapped int64.
+    r = exact("2^64%10");
+    CHECK(r.integral && r.exact == 6);
+    r = exact("1e19%7");
+    CHECK(r.integral && r.exact == 3);
+    r = exact("-(2^70)%3");
+    CHECK(r.integral && r.exact == -1);
+    r = exact("9223372036854775807%10");
+    CHECK(r.integral && r.exact == 7);
+    CHECK(exact("2^64%0.5").error == ErrorCode::ModuloByZero);
+    CHECK(Parser("2^64%0.5").tryParse().error == ErrorCode::ModuloByZero);
+
+    // One rule for every operator: a whole double result is integral.
+    CHECK(exact("2^-1*2").integral);
+    CHECK(exact("0.5^0").integral);
+    CHECK(exact("0.5+0.5").integral);
+    CHECK(exact("1.5-0.5").integral);
+    CHECK(exact("3/2*2").integral);
+    CHECK(!exact("2^-1").integral);
+    r = exact("9223372036854775807+1");
+    CHECK(!r.integral && r.value == 9223372036854775808.0);
+    return checkFailures != 0;
+}
@@ -0,0 +1,29 @@
+// fail_alloc.hpp - replaces the global operator new so a test can make large
+// allocations fail: while failAllocsFrom is set, any request of that many
+// bytes or more throws bad_alloc, on every thread. Small allocations (frames,
+// results, bookkeeping) still succeed. Include from one file per test.
+#ifndef CALC_TESTS_FAIL_ALLOC_HPP
+#define CALC_TESTS_FAIL_ALLOC_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+inline std::atomic<std::size_t> failAllocsFrom{SIZE_MAX};
+
+// GCC pairs the library's inlined new-expressions with the free() below and
+// warns, though both sides are these replacements.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(std::size_t n) {
+    if (n >= failAllocsFrom.load(std::memory_order_relaxed)) throw std::bad_alloc();
+    if (void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+#endif // CALC_TESTS_FAIL_ALLOC_HPP
@@ -0,0 +1,96 @@
+// gradient.cpp - forward mode (tryDerivative along a unit vector) and
+// reverse mode (tryGradient) agree, including at negative bases of '^' and
+// at infinite inputs, where partials are NaN or inf.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::max;
+using std::string;
+
+static bool close(double a, double b) {
+    if (a != a || b != b) return a != a && b != b;
+    if (a == b) return true;
+    return fabs(a - b) <= 1e-12 * max(fabs(a), fabs(b));
+}
+
+// Whether the derivative along dir matches the gradient: their dot product,
+// where (as in both modes) a zero factor makes its term 0.
+static bool agree(const Program& prog, const double* vars, const double* dir, const char* src) {
+    double grad[3], fwd, dot = 0;
+    EvalResult r = prog.tryGradient(vars, grad), f = prog.tryDerivative(vars, dir, &fwd);
+    for (size_t i = 0; i < 3; ++i)
+        if (dir[i] != 0 && grad[i] != 0) dot += dir[i] * grad[i];
+    if (f.error != r.error) return false;
+    if (!r.ok() || close(fwd, dot)) return true;
+    fprintf(stderr, "  %s at %g,%g,%g along %g,%g,%g: forward %g, reverse %g\n", src, vars[0], vars[1], vars[2],
+            dir[0], dir[1], dir[2], fwd, dot);
+    return false;
+}
+
+// Along each axis. (Mixed directions need not agree at inf or NaN: their
+// tangents can cancel to 0, or sum to inf - inf, in one mode only.)
+static bool agree(const string& src, const double* vars) {
+    Parser p(src, {"x", "y", "z"});
+    if (!p.tryCompile().ok()) return false;
+    const double dirs[][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    bool ok = true;
+    for (const double* d : dirs) ok = agree(p.program(), vars, d, src.c_str()) && ok;
+    return ok;
+}
+
+// Random formulas using each of x, y, z at most once. With one path from each
+// variable to the result the two modes multiply the same partials, so they
+// agree; several paths can cancel to 0 in one mode and inf - inf in the other.
+struct Gen {
+    std::mt19937 rng{7};
+    string unused = "xyz";
+    string leaf() {
+        if (unused.empty() || rng() % 3 == 0) return std::to_string(rng() % 5) + ".5";
+        size_t k = rng() % unused.size();
+        string v(1, unused[k]);
+        unused.erase(k, 1);
+        return v;
+    }
+    string expr(int d) {
+        if (d == 0 || rng() % 5 == 0) return leaf();
+        switch (rng() % 8) {
+        case 0:  return "(" + expr(d - 1) + "+" + expr(d - 1) + ")";
+        case 1:  return "(" + expr(d - 1) + "-" + expr(d - 1) + ")";
+        case 2:  return "(" + expr(d - 1) + "*" + expr(d - 1) + ")";
+        case 3:  return "(" + expr(d - 1) + "/" + expr(d - 1) + ")";
+        case 4:  return "(" + expr(d - 1) + ")^" + expr(d - 1);
+        case 5:  return "(" + expr(d - 1) + ")^" + std::to_string(rng() % 4);
+        case 6:  return "-(" + expr(d - 1) + ")";
+        default: return "(" + expr(d - 1) + "%3+" + expr(d - 1) + ")";
+        }
+    }
+};
+
+int main() {
+    const double inf = INFINITY;
+    double at[][3] = {{-2, 0.5, 1}, {-2, 3, 1}, {-0.5, -1.5, 2}, {0, 2, -1}, {inf, 2, 1}, {-inf, 3, 1},
+                      {2, inf, -inf}, {-3, -inf, inf}, {1, 0, -2}, {0, 0, 0}};
+    const char* cases[] = {"x^y", "x^y*z", "(x*z)^y", "x^(y*z)", "x^2+y^z", "x*0+y", "(x%3)*y+z", "-(x)^y",
+                           "y^0.5*x", "x/y-z", "(x+y)^2", "z^(x%2)", "(x^0.5)%3+y", "x^0.5*y", "(x^0.5+y)*0",
+                           // a flat operand whose input's own partial is inf or NaN
+                           "(y-y)^0.5%3+y", "((x-x)^0.5)%3*z+x", "(x^(y-y)^0.5)%3+y"};
+    for (const char* s : cases)
+        for (const double* v : at) CHECK(agree(s, v));
+
+    Gen g;
+    std::mt19937 pick(3);
+    double values[] = {-4, -2.5, -1, -0.5, 0, 0.5, 1, 2, 3.5, inf, -inf};
+    for (int i = 0; i < 3000; ++i) {
+        g.unused = "xyz";
+        string s = g.expr(4);
+        for (int k = 0; k < 10; ++k) {
+            double v[3] = {values[pick() % 11], values[pick() % 11], values[pick() % 11]};
+            CHECK(agree(s, v));
+        }
+    }
+    return checkFailures != 0;
+}
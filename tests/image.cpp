@@ -0,0 +1,148 @@
+// image.cpp - program images round-trip: a mapped image runs every program
+// exactly as the one saved, with the same sources and variable names. A
+// truncated, bit-flipped or wrong-version file either comes back !ok() with a
+// reason or opens as programs that still run within their bounds (a flipped
+// literal is still a literal); it never crashes.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace calc;
+using std::vector;
+
+static const char* kPath = "test_image.calcimg";
+
+static vector<char> readAll(const char* path) {
+    vector<char> bytes;
+    if (FILE* f = std::fopen(path, "rb")) {
+        char buf[4096];
+        for (size_t n; (n = std::fread(buf, 1, sizeof buf, f)) > 0;) bytes.insert(bytes.end(), buf, buf + n);
+        std::fclose(f);
+    }
+    return bytes;
+}
+
+static void writeAll(const char* path, const char* data, size_t n) {
+    FILE* f = std::fopen(path, "wb");
+    CHECK(f != nullptr);
+    if (!f) return;
+    CHECK(std::fwrite(data, 1, n, f) == n);
+    std::fclose(f);
+}
+
+// Runs every program of an image that opened, on variables 0.5, 1.5, ...
+static void runAll(const ProgramImage& img) {
+    double vars[64];
+    for (size_t i = 0; i < 64; ++i) vars[i] = 0.5 + static_cast<double>(i);
+    for (size_t i = 0; i < img.size(); ++i) {
+        ProgramRef p = img.program(i);
+        p.tryRun(img.variableCount(i) <= 64 ? vars : nullptr);
+        p.tryRunExact(img.variableCount(i) <= 64 ? vars : nullptr);
+        for (size_t s = 0; s < img.variableCount(i); ++s) img.variable(i, s);
+        img.source(i);
+    }
+}
+
+int main() {
+    const char* sources[] = {
+        "1 + 2 * 3",
+        "x * y - z",
+        "(b ^ 2 - 4 * a * c) ^ 0.5",
+        "9007199254740993 % 10 + n",  // an exact literal beyond 2^53
+        "x / (y - y)",
+        "w % 0",
+        "-(-(alpha)) + beta ^ -2",
+        "",
+    };
+    const size_t count = sizeof sources / sizeof *sources;
+    vector<Program> progs;
+    ImageWriter writer;
+    for (const char* src : sources) {
+        Parser p(src);
+        if (*src) CHECK(p.tryCompile().ok());
+        progs.push_back(p.program());
+        if (progs.size() % 2) progs.back().optimize();
+        writer.add(progs.back(), src);
+    }
+    CHECK(writer.size() == count);
+    CHECK(writer.save(kPath));
+
+    {
+        ProgramImage img(kPath);
+        CHECK(img.ok());
+        CHECK(img.error() == nullptr);
+        CHECK(img.size() == count);
+        const double vars[] = {3, 0.25, -7};
+        for (size_t i = 0; i < img.size() && i < count; ++i) {
+            const Program& want = progs[i];
+            ProgramRef got = img.program(i);
+            CHECK(img.source(i) == sources[i]);
+            CHECK(img.variableCount(i) == want.variables().size());
+            for (size_t s = 0; s < img.variableCount(i); ++s) CHECK(img.variable(i, s) == want.variables()[s]);
+            EvalResult a = want.tryRun(vars), b = got.tryRun(vars);
+            CHECK(a.error == b.error && a.pos == b.pos);
+            CHECK(!a.ok() || sameBits(a.value, b.value));
+            EvalResult ae = want.tryRunExact(vars), be = got.tryRunExact(vars);
+            CHECK(ae.error == be.error && ae.pos == be.pos && ae.integral == be.integral && ae.exact == be.exact);
+            if (!want.variables().empty()) CHECK(got.tryRun().error == ErrorCode::UnboundVariable);
+        }
+    }
+
+    vector<char> bytes = readAll(kPath);
+    CHECK(bytes.size() > sizeof(ImageHeader));
+
+    // every truncation, down to an empty file
+    for (size_t n = 0; n < bytes.size(); ++n) {
+        writeAll(kPath, bytes.data(), n);
+        ProgramImage img(kPath);
+        CHECK(!img.ok());
+        CHECK(img.error() != nullptr);
+        CHECK(img.size() == 0);
+    }
+
+    // one flipped bit at a time, each bit of every byte
+    for (size_t at = 0; at < bytes.size(); ++at) {
+        for (int bit = 0; bit < 8; ++bit) {
+            vector<char> bad = bytes;
+            bad[at] = static_cast<char>(bad[at] ^ (1 << bit));
+            writeAll(kPath, bad.data(), bad.size());
+            ProgramImage img(kPath);
+            if (img.ok()) runAll(img);
+            else CHECK(img.error() != nullptr && img.size() == 0);
+        }
+    }
+
+    // another version, and another Instr layout
+    {
+        vector<char> bad = bytes;
+        ImageHeader h;
+        std::memcpy(&h, bad.data(), sizeof h);
+        h.version = kImageVersion + 1;
+        std::memcpy(bad.data(), &h, sizeof h);
+        writeAll(kPath, bad.data(), bad.size());
+        ProgramImage img(kPath);
+        CHECK(!img.ok());
+        CHECK(img.error() != nullptr && std::strstr(img.error(), "version") != nullptr);
+    }
+    {
+        vector<char> bad = bytes;
+        ImageHeader h;
+        std::memcpy(&h, bad.data(), sizeof h);
+        h.instrSize = 16;
+        std::memcpy(bad.data(), &h, sizeof h);
+        writeAll(kPath, bad.data(), bad.size());
+        ProgramImage img(kPath);
+        CHECK(!img.ok());
+    }
+    {
+        ProgramImage img("test_image.missing");
+        CHECK(!img.ok());
+        CHECK(img.error() != nullptr);
+    }
+
+    std::remove(kPath);
+    return checkFailures != 0;
+}
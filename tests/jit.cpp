@@ -0,0 +1,89 @@
+// jit.cpp - NativeCode::tryRun agrees with Program::tryRun: the same value
+// bits, or the same error at the same position. Stack depths straddle the 12
+// values held in registers and the 64-entry spill array on the native stack,
+// so every value path is covered: in a register, spilled around a call, and
+// in the heap spill area. Only a NaN may differ (see sameBits).
+// Skipped where compile() returns null.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// A right-nested chain: each operator still waits for its right operand, so
+// the value stack reaches `depth` + 1 at the innermost leaf.
+static string chain(std::mt19937& rng, int depth) {
+    static const char* ops[] = {"+", "-", "*", "/", "%", "^"};
+    static const char* exponents[] = {"2", "3", "0.5", "5", "-2"};
+    string s = leaf(rng);
+    for (int i = 0; i < depth; ++i) {
+        string a = leaf(rng);
+        if (rng() % 4 == 0) a = "(" + a + ")^" + exponents[rng() % 5]; // Square/Cube/Sqrt/PowInt once optimized
+        s = a + ops[rng() % 6] + "(" + s + ")";
+    }
+    return s;
+}
+
+static void compare(const Program& prog, std::mt19937& rng, int& compiled) {
+    unique_ptr<NativeCode> nc = NativeCode::compile(prog);
+    if (!nc) return;
+    ++compiled;
+    size_t nv = prog.variables().size();
+    CHECK(!nv || nc->tryRun().error == ErrorCode::UnboundVariable);
+    vector<double> vars(nv);
+    for (int round = 0; round < 20; ++round) {
+        for (double& v : vars) v = kValues[rng() % (sizeof kValues / sizeof *kValues)];
+        EvalResult want = prog.tryRun(vars.data()), got = nc->tryRun(vars.data());
+        CHECK(got.error == want.error);
+        CHECK(got.pos == want.pos);
+        CHECK(!want.ok() || sameBits(got.value, want.value));
+    }
+}
+
+int main() {
+    std::mt19937 rng(18);
+    const int depths[] = {0, 1, 2, 9, 10, 11, 12, 13, 14, 20, 60, 62, 63, 64, 65, 66, 100, 300};
+    int compiled = 0, errors = 0;
+    for (int depth : depths) {
+        for (int i = 0; i < 40; ++i) {
+            string src = chain(rng, depth); // the parser views it
+            Parser p(src, {"x", "y", "z"});
+            CHECK(p.tryCompile().ok());
+            compare(p.program(), rng, compiled);
+            for (bool strict : {true, false}) {
+                Program prog = p.program();
+                prog.optimize(strict);
+                compare(prog, rng, compiled);
+            }
+        }
+    }
+    // Division and modulo by zero at a known position, below and above both
+    // thresholds: "x+(x+(...(x/0)))" fails at the '/'.
+    for (int depth : {1, 11, 12, 13, 63, 64, 65, 200}) {
+        for (const char* op : {"/", "%"}) {
+            string src;
+            for (int i = 0; i < depth; ++i) src += "x+(";
+            size_t pos = src.size() + 1;
+            src += string("x") + op + "y";
+            src += string(depth, ')');
+            Parser p(src, {"x", "y"});
+            CHECK(p.tryCompile().ok());
+            unique_ptr<NativeCode> nc = NativeCode::compile(p.program());
+            if (!nc) continue;
+            const double vars[] = {1, 0};
+            EvalResult r = nc->tryRun(vars);
+            CHECK(r.error == (*op == '/' ? ErrorCode::DivisionByZero : ErrorCode::ModuloByZero));
+            CHECK(r.pos == pos);
+            CHECK(r.pos == p.program().tryRun(vars).pos);
+            ++errors;
+        }
+    }
+    if (!compiled) std::fprintf(stderr, "jit: no native code here, skipped\n");
+    CHECK(!compiled || errors == 16);
+    return checkFailures != 0;
+}
@@ -0,0 +1,55 @@
+// lexer.cpp - the run scanners of lexKernels() agree with the Lexer's own
+// predicates at every offset and length: runs of 0..200 bytes starting at
+// each misalignment of a 64-byte vector, broken by every byte value at every
+// position, over buffers that end exactly at n so an overread is caught
+// under a sanitizer.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::string;
+using std::vector;
+
+static size_t scalar(bool (*in)(char), const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && in(s[i])) ++i;
+    return i;
+}
+
+static void compare(const char* name, size_t (*kernel)(const char*, size_t), bool (*in)(char), std::mt19937& rng) {
+    string members;
+    for (int c = 0; c < 256; ++c)
+        if (in(static_cast<char>(c))) members += static_cast<char>(c);
+    int breaker = 0, failures = 0;
+    for (size_t off = 0; off < 64; ++off) {
+        for (size_t len = 0; len <= 200; ++len) {
+            vector<char> buf(off + len);
+            char* s = buf.data() + off;
+            for (size_t i = 0; i < len; ++i) s[i] = members[rng() % members.size()];
+            for (size_t at = 0; at <= len; ++at) {
+                char keep = at < len ? s[at] : 0;
+                if (at < len) { // the next byte value, whichever class it is in
+                    s[at] = static_cast<char>(breaker);
+                    breaker = (breaker + 1) % 256;
+                }
+                if (kernel(s, len) != scalar(in, s, len)) ++failures;
+                if (at < len) s[at] = keep;
+            }
+        }
+    }
+    if (failures) std::fprintf(stderr, "%s (%s): %d mismatches\n", name, lexKernels().isa, failures);
+    CHECK(failures == 0);
+}
+
+int main() {
+    std::mt19937 rng(28);
+    const LexKernels& k = lexKernels();
+    CHECK(k.isa != nullptr);
+    compare("spaces", k.spaces, [](char c) { return Lexer::isSpace(c); }, rng);
+    compare("digits", k.digits, [](char c) { return Lexer::isDigit(c); }, rng);
+    compare("ident", k.ident, [](char c) { return Lexer::isIdentChar(c); }, rng);
+    return checkFailures != 0;
+}
@@ -0,0 +1,67 @@
+// limits.cpp - per-expression budgets: both engines fail with the same code
+// at the same position, and depth counts nesting, not operators.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::string;
+
+static EvalResult compile(const string& src, Parser::Engine e, const Limits& l) {
+    Parser p(src);
+    p.setEngine(e);
+    p.setLimits(l);
+    return p.tryCompile();
+}
+
+static size_t depthNeeded(const char* src) {
+    for (size_t d = 1;; ++d) {
+        Limits l;
+        l.depth = d;
+        if (Parser(src).tryCompile().ok() == compile(src, Parser::Engine::Precedence, l).ok()) return d;
+    }
+}
+
+static string gen(std::mt19937& rng, int d) {
+    if (d == 0 || rng() % 5 == 0) return rng() % 2 ? "x" : std::to_string(rng() % 9 + 1);
+    switch (rng() % 9) {
+    case 0:  return gen(rng, d - 1) + "+" + gen(rng, d - 1);
+    case 1:  return gen(rng, d - 1) + "-" + gen(rng, d - 1);
+    case 2:  return gen(rng, d - 1) + "*" + gen(rng, d - 1);
+    case 3:  return gen(rng, d - 1) + "/" + gen(rng, d - 1);
+    case 4:  return gen(rng, d - 1) + "^" + gen(rng, d - 1);
+    case 5:  return "(" + gen(rng, d - 1) + ")";
+    case 6:  return "-" + gen(rng, d - 1);
+    case 7:  return "+" + gen(rng, d - 1);
+    default: return gen(rng, d - 1) + "(" + gen(rng, d - 1) + ")";
+    }
+}
+
+int main() {
+    // Binary operators do not nest; '(', signs and '^' do.
+    Limits one;
+    one.depth = 1;
+    CHECK(compile("1+2*3-4/5%6", Parser::Engine::Precedence, one).ok());
+    CHECK(depthNeeded("1+2*3^4") == 1);
+    CHECK(depthNeeded("2^3^4") == 2);
+    CHECK(depthNeeded("-(+1)") == 3);
+    CHECK(depthNeeded("2*(3+(4-5))*6") == 2);
+    EvalResult r = compile("1*((2))", Parser::Engine::Precedence, one);
+    CHECK(r.error == ErrorCode::NestingTooDeep && r.pos == 3);
+
+    std::mt19937 rng(5);
+    for (int i = 0; i < 20000; ++i) {
+        string s = gen(rng, 6);
+        Limits l;
+        l.depth = rng() % 6 + 1;
+        if (i % 3 == 0) l.steps = rng() % 40 + 1;
+        if (i % 5 == 0) l.tokens = rng() % 60 + 1;
+        EvalResult a = compile(s, Parser::Engine::Precedence, l), b = compile(s, Parser::Engine::Recursive, l);
+        if (a.error != b.error || a.pos != b.pos)
+            fprintf(stderr, "  %s: %s vs %s\n", s.c_str(), a.message().c_str(), b.message().c_str());
+        CHECK(a.error == b.error && a.pos == b.pos);
+    }
+    return checkFailures != 0;
+}
@@ -0,0 +1,73 @@
+// metrics.cpp - LatencyHistogram buckets tile the whole 64-bit range with
+// every value within 1/16 (6.25%) of its bucket's bounds, and a Metrics
+// snapshot merges the per-thread shards into exact totals, never mixing two
+// Metrics recorded from the same thread.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace calc;
+
+using H = LatencyHistogram;
+
+static void checkBucket(uint64_t v) {
+    size_t b = H::bucketOf(v);
+    CHECK(b < H::kBuckets);
+    CHECK(H::lowest(b) <= v && v <= H::highest(b));
+    CHECK(H::highest(b) - H::lowest(b) <= H::lowest(b) / 16); // width 0 below 16
+}
+
+int main() {
+    for (size_t b = 0; b < H::kBuckets; ++b) {
+        CHECK(H::bucketOf(H::lowest(b)) == b && H::bucketOf(H::highest(b)) == b);
+        if (b + 1 < H::kBuckets) CHECK(H::highest(b) + 1 == H::lowest(b + 1));
+    }
+    CHECK(H::lowest(0) == 0 && H::highest(H::kBuckets - 1) == UINT64_MAX);
+    for (unsigned e = 0; e < 64; ++e) {
+        uint64_t p = uint64_t(1) << e;
+        checkBucket(p - 1);
+        checkBucket(p);
+        checkBucket(p + 1);
+    }
+    std::mt19937_64 rng(22);
+    for (int i = 0; i < 100000; ++i) checkBucket(rng() >> (rng() % 64));
+
+    // Each thread records its own values; the snapshot is their exact merge.
+    Metrics m, other;
+    const int threads = 6, perThread = 5000;
+    std::vector<std::thread> pool;
+    for (int t = 0; t < threads; ++t)
+        pool.emplace_back([&m, &other, t] {
+            for (int i = 0; i < perThread; ++i) {
+                uint64_t ns = uint64_t(t + 1) * 1000 + uint64_t(i);
+                m.record(Metrics::Eval, ns);
+                m.count(i % 3 ? ErrorCode::None : ErrorCode::DivisionByZero);
+                if (i % 10 == 0) other.record(Metrics::Eval, 1); // same thread, second Metrics
+            }
+        });
+    for (std::thread& th : pool) th.join();
+
+    H::Snapshot want;
+    uint64_t wantSum = 0, wantMax = 0;
+    for (int t = 0; t < threads; ++t)
+        for (int i = 0; i < perThread; ++i) {
+            uint64_t ns = uint64_t(t + 1) * 1000 + uint64_t(i);
+            ++want.counts[H::bucketOf(ns)];
+            wantSum += ns;
+            wantMax = std::max(wantMax, ns);
+        }
+    H::Snapshot s = m.snapshot(Metrics::Eval);
+    CHECK(s.total == uint64_t(threads) * perThread);
+    CHECK(s.sum == wantSum && s.max == wantMax);
+    CHECK(s.counts == want.counts);
+    CHECK(m.snapshot(Metrics::Parse).total == 0);
+    CHECK(m.outcomes(ErrorCode::DivisionByZero) == uint64_t(threads) * ((perThread + 2) / 3));
+    CHECK(m.outcomes(ErrorCode::None) + m.outcomes(ErrorCode::DivisionByZero) == s.total);
+    H::Snapshot o = other.snapshot(Metrics::Eval);
+    CHECK(o.total == uint64_t(threads) * (perThread / 10) && o.max == 1);
+    return checkFailures != 0;
+}
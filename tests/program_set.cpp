@@ -0,0 +1,129 @@
+// program_set.cpp - a ProgramSet gives every added program the same result
+// as running it alone: values bit for bit, errors with the same code and the
+// source position a lone run reports, also through shared Div/Mod nodes. And
+// clear() keeps the node arena, so a refill of the same shape allocates nothing.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <random>
+#include <string>
+
+using namespace calc;
+using std::string;
+using std::vector;
+
+static bool same(const EvalResult& a, const EvalResult& b) {
+    if (a.error != b.error || a.pos != b.pos) return false;
+    return !a.ok() || sameBits(a.value, b.value);
+}
+
+// Formulas built from a small pool of shared pieces, so subtrees repeat
+// within and across programs, often around a '/' or '%' that can fail.
+static string formula(std::mt19937& rng, const vector<string>& pool, int d) {
+    if (d == 0 || rng() % 3 == 0) return pool[rng() % pool.size()];
+    static const char* ops[] = {"+", "-", "*", "/", "%", "^"};
+    string a = formula(rng, pool, d - 1), b = formula(rng, pool, d - 1);
+    return rng() % 6 == 0 ? "-(" + a + ")" : "(" + a + ops[rng() % 6] + b + ")";
+}
+
+int main() {
+    std::mt19937 rng(12);
+    const vector<string> pool = {"x", "y", "z", "w", "2", "0.5", "(x-y)", "(x/y)", "(z%w)", "(x*y+z)", "(1/(x-1))",
+                                 "(y^2)", "(w%2)"};
+    const double values[] = {0, 1, -1, 2, 0.5, 3, -2.5, 1e300, INFINITY, NAN};
+    for (int round = 0; round < 300; ++round) {
+        vector<string> srcs;
+        vector<Program> progs;
+        ProgramSet set;
+        for (int i = 0; i < 40; ++i) {
+            srcs.push_back(formula(rng, pool, 4));
+            // a single space in front moves every position: shared nodes must
+            // still report the position of the program that introduced them
+            if (rng() % 2) srcs.back() = " " + srcs.back();
+        }
+        for (const string& s : srcs) {
+            Parser p(s);
+            CHECK(p.tryCompile().ok());
+            progs.push_back(p.program());
+            if (round % 2) progs.back().optimize();
+            CHECK(set.add(progs.back()) == progs.size() - 1);
+        }
+        CHECK(set.nodeCount() <= set.instructionsAdded());
+
+        const size_t rows = 37;
+        size_t nv = set.variables().size();
+        vector<vector<double>> cols(nv, vector<double>(rows));
+        vector<const double*> colPtrs;
+        for (auto& c : cols) {
+            for (double& v : c) v = values[rng() % (sizeof values / sizeof *values)];
+            colPtrs.push_back(c.data());
+        }
+        vector<double> vars(nv), local;
+        vector<EvalResult> results(progs.size());
+        for (size_t row = 0; row < rows; ++row) {
+            for (size_t i = 0; i < nv; ++i) vars[i] = cols[i][row];
+            set.run(vars.data(), results.data());
+            for (size_t r = 0; r < progs.size(); ++r) {
+                local.clear();
+                for (const string& name : progs[r].variables()) {
+                    size_t k = 0;
+                    while (set.variables()[k] != name) ++k;
+                    local.push_back(vars[k]);
+                }
+                EvalResult alone = progs[r].tryRun(local.data());
+                if (!same(results[r], alone))
+                    fprintf(stderr, "  %s: %s vs %s\n", srcs[r].c_str(), results[r].message().c_str(),
+                            alone.message().c_str());
+                CHECK(same(results[r], alone));
+            }
+        }
+
+        // Column form against each program's own tryRunBatch.
+        vector<vector<double>> outs(progs.size(), vector<double>(rows));
+        vector<double*> outPtrs;
+        for (auto& o : outs) outPtrs.push_back(o.data());
+        vector<EvalResult> status(progs.size());
+        set.runBatch(colPtrs.data(), rows, outPtrs.data(), status.data());
+        for (size_t r = 0; r < progs.size(); ++r) {
+            vector<const double*> own;
+            for (const string& name : progs[r].variables()) {
+                size_t k = 0;
+                while (set.variables()[k] != name) ++k;
+                own.push_back(cols[k].data());
+            }
+            vector<double> expect(rows);
+            EvalResult alone = progs[r].tryRunBatch(own.data(), rows, expect.data());
+            CHECK(status[r].error == alone.error && status[r].pos == alone.pos);
+            if (alone.ok())
+                for (size_t row = 0; row < rows; ++row) CHECK(sameBits(outs[r][row], expect[row]));
+        }
+    }
+
+    // clear() keeps the arena's memory: refilling with the same programs
+    // allocates no further block.
+    {
+        vector<Program> progs;
+        for (int i = 0; i < 3000; ++i) {
+            string src = formula(rng, pool, 6);
+            Parser p(src);
+            CHECK(p.tryCompile().ok());
+            progs.push_back(p.program());
+        }
+        ProgramSet set;
+        for (const Program& p : progs) set.add(p);
+        const Arena& mem = set.memory();
+        CHECK(mem.growCount() > 1); // past the first block
+        size_t firstUsed = mem.bytesUsed();
+        set.clear(); // one block now, as big as all the earlier ones
+        CHECK(mem.bytesUsed() == 0 && mem.bytesReserved() >= firstUsed);
+        size_t grows = mem.growCount(), reserved = mem.bytesReserved(), used = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            for (const Program& p : progs) set.add(p);
+            CHECK(mem.growCount() == grows && mem.bytesReserved() == reserved);
+            CHECK(pass == 0 || mem.bytesUsed() == used);
+            used = mem.bytesUsed();
+            set.clear();
+        }
+    }
+    return checkFailures != 0;
+}
@@ -0,0 +1,116 @@
+// result_cache.cpp - a ResultCache hit on input that differs only in spacing
+// reports what a fresh parse of that input would, positions and unbound names
+// included; hits and misses are counted, and the byte cap evicts the least
+// recently used entries.
+#include "calc.hpp"
+#include "check.hpp"
+
+#include <cstring>
+#include <string>
+
+using namespace calc;
+using std::max;
+using std::string;
+
+// The same tokens with spaces around every operator and parenthesis, so
+// every later offset moves.
+static string respace(const string& src) {
+    string out;
+    for (char c : src) {
+        if (strchr("+-*/%^()", c)) out += ' ';
+        out += c;
+        if (strchr("+-*/%^()", c)) out += "  ";
+    }
+    return out;
+}
+
+static bool sameResult(const EvalResult& a, const EvalResult& b) {
+    if (a.error != b.error || a.pos != b.pos || a.detail != b.detail) return false;
+    return !a.ok() || sameBits(a.value, b.value);
+}
+
+int main() {
+    const char* srcs[] = {"1+2*3", "2^10-3(4)", "7%3", "1/0", "2*(3-3)%4+1", "(1+2", "1+2)", "4*+", "y*2+3",
+                          "1+(2*zed)+3", "(x-y)/x", "1e999+1", "2)3"};
+    {
+        ResultCache cache(1 << 20);
+        Parser p("");
+        size_t n = 0;
+        for (const char* s : srcs) {
+            string spaced = respace(s);
+            CHECK(spaced != s);
+            p.reset(s);
+            CHECK(sameResult(cache.evaluate(p), Parser(s).tryParse()));
+            p.reset(spaced);
+            EvalResult hit = cache.evaluate(p);
+            EvalResult fresh = Parser(spaced).tryParse();
+            CHECK(sameResult(hit, fresh));
+            if (!hit.detail.empty()) // names point into the caller's own input
+                CHECK(hit.detail.data() >= p.source().data() &&
+                      hit.detail.data() + hit.detail.size() <= p.source().data() + p.source().size());
+            ++n;
+            ResultCache::Stats st = cache.stats();
+            CHECK(st.misses == n && st.hits == n && st.entries == n);
+        }
+        p.reset("1 + 2 * 4"); // a new key
+        cache.evaluate(p);
+        CHECK(cache.stats().misses == n + 1 && cache.stats().hits == n);
+    }
+
+    // One shard, so the cap applies to a single LRU list.
+    {
+        const size_t cap = 4096;
+        ResultCache cache(cap, 1);
+        Parser p("");
+        p.reset("x+1");
+        cache.evaluate(p);
+        size_t most = 0;
+        for (int i = 0; i < 500; ++i) {
+            p.reset("1+" + std::to_string(i));
+            cache.evaluate(p);
+            p.reset("x + 1"); // kept at the front, so never the one evicted
+            cache.evaluate(p);
+            ResultCache::Stats st = cache.stats();
+            CHECK(st.bytes <= cap);
+            most = max(most, st.entries);
+        }
+        ResultCache::Stats st = cache.stats();
+        CHECK(most > 2 && most < 500);
+        CHECK(st.hits == 500 && st.misses == 501);
+        p.reset("1+499");
+        cache.evaluate(p); // most recent: still there
+        CHECK(cache.stats().hits == 501);
+        p.reset("1+0");
+        cache.evaluate(p); // oldest: evicted long ago
+        CHECK(cache.stats().misses == 502);
+    }
+
+    // Limits are part of the key: a parser on a tighter budget never gets a
+    // looser parser's result for the same tokens, nor the other way round.
+    {
+        ResultCache cache(1 << 20);
+        Limits shallow, deep;
+        shallow.depth = 2;
+        deep.depth = 8;
+        Parser a(""), b("");
+        a.setLimits(shallow);
+        b.setLimits(deep);
+        const string srcs[] = {"((((1))))", "( ( ( ( 1 ) ) ) )"};
+        for (const string& s : srcs) {
+            a.reset(s);
+            CHECK(cache.evaluate(a).error == ErrorCode::NestingTooDeep);
+            b.reset(s);
+            CHECK(cache.evaluate(b).ok());
+        }
+        ResultCache::Stats st = cache.stats();
+        CHECK(st.misses == 2 && st.hits == 2 && st.entries == 2);
+
+        Limits few;
+        few.steps = 3;
+        Parser c("1+2+3"), d("1 + 2 + 3");
+        c.setLimits(few);
+        CHECK(cache.evaluate(d).ok());
+        CHECK(cache.evaluate(c).error == ErrorCode::TooManySteps);
+    }
+    return checkFailures != 0;
+}
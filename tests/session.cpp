@@ -0,0 +1,82 @@
+// session.cpp - Session: rejected definitions leave nothing behind, wide
+// waves on the pool match one thread, assign() trims like the lexer, and a
+// recompute() that runs out of memory throws and can be retried.
+#include "calc.hpp"
+#include "check.hpp"
+#include "fail_alloc.hpp"
+
+#include <string>
+
+using namespace calc;
+using std::string;
+
+int main() {
+    Session s;
+    CHECK(s.define("a", "b*2").ok());
+    s.set("b", 3);
+    size_t before = s.size(); // a, b
+    CHECK(before == 2);
+
+    // b = a + fresh would be a cycle; fresh must not become an input.
+    CHECK(s.define("b", "a + fresh").error == ErrorCode::CyclicDefinition);
+    CHECK(s.size() == before);
+    CHECK(s.define("c", "c + other").error == ErrorCode::CyclicDefinition);
+    CHECK(s.size() == before);
+    CHECK(s.assign("d = d").error == ErrorCode::CyclicDefinition);
+    CHECK(s.size() == before);
+    s.recompute();
+    CHECK(s.value("a").value == 6);
+    CHECK(s.value("fresh").error == ErrorCode::UnboundVariable);
+
+    // The whitespace the grammar skips, no more: '\v' and '\f' too.
+    CHECK(s.assign("\v\f e \t= a + 1").ok());
+    s.recompute();
+    CHECK(s.value("e").value == 7);
+    CHECK(s.assign("\xa0" "f = 1").error == ErrorCode::BadAssignment);
+
+    // A wave wide enough to be spread over the pool, several ticks running.
+    Session one(1), four(4);
+    for (Session* t : {&one, &four}) {
+        for (int i = 0; i < 5000; ++i) {
+            string n = "n" + std::to_string(i);
+            t->define(n, "x*" + std::to_string(i) + " + y%" + std::to_string(i % 7 + 1));
+            t->define("m" + std::to_string(i), n + "^2 - x");
+        }
+    }
+    for (int tick = 0; tick < 20; ++tick) {
+        for (Session* t : {&one, &four}) {
+            t->set("x", tick * 0.5);
+            t->set("y", tick + 3);
+        }
+        CHECK(one.recompute().recomputed == four.recompute().recomputed);
+        for (int i = 0; i < 5000; i += 97) {
+            string m = "m" + std::to_string(i);
+            CHECK(one.value(m).value == four.value(m).value);
+        }
+    }
+
+    // A node 140000 deep needs a heap value stack of over 1 MB, which is made
+    // to fail, in a wave wide enough for the pool.
+    Session oom(4);
+    string deep;
+    for (int i = 0; i < 140000; ++i) deep += "x+(";
+    deep += "x" + string(140000, ')');
+    CHECK(oom.define("deep", deep).ok());
+    for (int i = 0; i < 1000; ++i) oom.define("w" + std::to_string(i), "x*" + std::to_string(i));
+    oom.set("x", 1);
+    bool threw = false;
+    failAllocsFrom = 1 << 20;
+    try {
+        oom.recompute();
+    } catch (const std::bad_alloc&) {
+        threw = true;
+    }
+    failAllocsFrom = SIZE_MAX;
+    CHECK(threw);
+    CHECK(oom.dirty());
+    oom.recompute();
+    CHECK(!oom.dirty());
+    CHECK(oom.value("deep").value == 140001);
+    CHECK(oom.value("w999").value == 999);
+    return checkFailures != 0;
+}